@@ -0,0 +1,456 @@
+//
+// MusicFS :: Batched stat() Engine
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#if defined(__NR_io_uring_setup) && defined(IO_URING_OP_SUPPORTED)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#define MUSICFS_LOG_SUBSYS "BatchStat"
+#include "logging.h"
+
+#include "batch_stat.h"
+
+using namespace std;
+
+// Batches smaller than this aren't worth the overhead of threads.
+static const size_t s_minThreadedBatch = 4;
+
+// Upper limit on threads used when io_uring isn't available.
+static const unsigned int s_maxThreads = 64;
+
+// How many times waiting for io_uring requests to finish may fail, after the ring has failed,
+// before giving up on them.
+static const unsigned int s_maxDrainFailures = 16;
+
+#ifdef HAVE_IO_URING
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void statx_to_stat(const struct statx& sx, struct stat& st)
+{
+    memset(&st, 0, sizeof(st));
+    st.st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    st.st_ino = sx.stx_ino;
+    st.st_mode = sx.stx_mode;
+    st.st_nlink = sx.stx_nlink;
+    st.st_uid = sx.stx_uid;
+    st.st_gid = sx.stx_gid;
+    st.st_rdev = makedev(sx.stx_rdev_major, sx.stx_rdev_minor);
+    st.st_size = sx.stx_size;
+    st.st_blksize = sx.stx_blksize;
+    st.st_blocks = sx.stx_blocks;
+    st.st_atim.tv_sec = sx.stx_atime.tv_sec;
+    st.st_atim.tv_nsec = sx.stx_atime.tv_nsec;
+    st.st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+    st.st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+    st.st_ctim.tv_sec = sx.stx_ctime.tv_sec;
+    st.st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+}
+
+#define RING_FIELD(_ring, _offset) reinterpret_cast<unsigned int*>(static_cast<char*>(_ring) + (_offset))
+#endif
+
+BatchStat::BatchStat(Method method, unsigned int depth)
+    : m_method(method)
+    , m_depth(max(depth, 1u))
+    , m_ringFd(-1)
+    , m_sqRing(nullptr)
+    , m_cqRing(nullptr)
+    , m_sqes(nullptr)
+    , m_sqRingSize(0)
+    , m_cqRingSize(0)
+    , m_sqesSize(0)
+    , m_sqEntries(0)
+    , m_sqOffHead(0), m_sqOffTail(0), m_sqOffMask(0), m_sqOffArray(0)
+    , m_cqOffHead(0), m_cqOffTail(0), m_cqOffMask(0), m_cqOffCqes(0)
+    , m_stop(false)
+    , m_generation(0)
+    , m_busy(0)
+    , m_paths(nullptr)
+    , m_results(nullptr)
+    , m_next(0)
+{
+    if (m_method == Method::Auto && !SetupRing())
+    {
+        m_method = Method::Threads;
+    }
+}
+
+BatchStat::~BatchStat()
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (thread& t : m_threads)
+    {
+        t.join();
+    }
+
+    TeardownRing();
+}
+
+const char *BatchStat::GetMethodName() const
+{
+    switch (m_method)
+    {
+    case Method::Auto:      return "io_uring";
+    case Method::Threads:   return "threads";
+    case Method::Sync:      return "synchronous";
+    }
+    return "unknown";
+}
+
+bool BatchStat::SetupRing()
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_params params = {};
+    m_ringFd = sys_io_uring_setup(m_depth, &params);
+    if (m_ringFd == -1)
+    {
+        DEBUG("io_uring unavailable: " << strerror(errno));
+        return false;
+    }
+
+    // Make sure this kernel's io_uring knows how to statx.
+    vector<char> probeBuf(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe*>(probeBuf.data());
+    if (sys_io_uring_register(m_ringFd, IORING_REGISTER_PROBE, probe, 256) == -1
+            || probe->last_op < IORING_OP_STATX
+            || !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED))
+    {
+        DEBUG("io_uring doesn't support statx");
+        TeardownRing();
+        return false;
+    }
+
+    m_sqEntries = params.sq_entries;
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMmap)
+    {
+        m_sqRingSize = m_cqRingSize = max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            m_ringFd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED)
+    {
+        m_sqRing = nullptr;
+        TeardownRing();
+        return false;
+    }
+
+    if (singleMmap)
+    {
+        m_cqRing = m_sqRing;
+    }
+    else
+    {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                m_ringFd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED)
+        {
+            m_cqRing = nullptr;
+            TeardownRing();
+            return false;
+        }
+    }
+
+    m_sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            m_ringFd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED)
+    {
+        m_sqes = nullptr;
+        TeardownRing();
+        return false;
+    }
+
+    m_sqOffHead = params.sq_off.head;
+    m_sqOffTail = params.sq_off.tail;
+    m_sqOffMask = params.sq_off.ring_mask;
+    m_sqOffArray = params.sq_off.array;
+    m_cqOffHead = params.cq_off.head;
+    m_cqOffTail = params.cq_off.tail;
+    m_cqOffMask = params.cq_off.ring_mask;
+    m_cqOffCqes = params.cq_off.cqes;
+
+    // The ring can't have more in flight than it has completion slots for.
+    m_depth = min(m_depth, params.sq_entries);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void BatchStat::TeardownRing()
+{
+#ifdef HAVE_IO_URING
+    if (m_sqes != nullptr)
+        munmap(m_sqes, m_sqesSize);
+    if (m_cqRing != nullptr && m_cqRing != m_sqRing)
+        munmap(m_cqRing, m_cqRingSize);
+    if (m_sqRing != nullptr)
+        munmap(m_sqRing, m_sqRingSize);
+    if (m_ringFd != -1)
+        close(m_ringFd);
+#endif
+    m_sqes = m_cqRing = m_sqRing = nullptr;
+    m_ringFd = -1;
+}
+
+bool BatchStat::StatWithRing(const vector<string>& paths, vector<StatResult>& results)
+{
+#ifdef HAVE_IO_URING
+    unsigned int *sqHead  = RING_FIELD(m_sqRing, m_sqOffHead);
+    unsigned int *sqTail  = RING_FIELD(m_sqRing, m_sqOffTail);
+    unsigned int sqMask   = *RING_FIELD(m_sqRing, m_sqOffMask);
+    unsigned int *sqArray = RING_FIELD(m_sqRing, m_sqOffArray);
+    unsigned int *cqHead  = RING_FIELD(m_cqRing, m_cqOffHead);
+    unsigned int *cqTail  = RING_FIELD(m_cqRing, m_cqOffTail);
+    unsigned int cqMask   = *RING_FIELD(m_cqRing, m_cqOffMask);
+    struct io_uring_cqe *cqes = reinterpret_cast<struct io_uring_cqe*>(
+            static_cast<char*>(m_cqRing) + m_cqOffCqes);
+    struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe*>(m_sqes);
+
+    // One statx buffer per request in flight; the slot number rides along as the user data.
+    unique_ptr<struct statx[]> buffers(new struct statx[m_depth]);
+    vector<size_t> slotRequest(m_depth);
+    vector<unsigned int> freeSlots;
+    for (unsigned int i = m_depth; i > 0; i--)
+        freeSlots.push_back(i - 1);
+
+    size_t next = 0;
+    size_t completed = 0;
+
+    auto reap = [&]()
+    {
+        unsigned int head = *cqHead;
+        unsigned int cqTailNow = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != cqTailNow)
+        {
+            const struct io_uring_cqe& cqe = cqes[head & cqMask];
+            unsigned int slot = static_cast<unsigned int>(cqe.user_data);
+            StatResult& result = results[slotRequest[slot]];
+
+            if (cqe.res < 0)
+            {
+                result.error = -cqe.res;
+            }
+            else
+            {
+                result.error = 0;
+                statx_to_stat(buffers[slot], result.st);
+            }
+
+            freeSlots.push_back(slot);
+            completed++;
+            head++;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    };
+
+    while (completed < paths.size())
+    {
+        unsigned int tail = *sqTail;
+        while (next < paths.size() && !freeSlots.empty()
+                && tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) < m_sqEntries)
+        {
+            unsigned int slot = freeSlots.back();
+            freeSlots.pop_back();
+            slotRequest[slot] = next;
+
+            unsigned int index = tail & sqMask;
+            struct io_uring_sqe *sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<unsigned long>(paths[next].c_str());
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = reinterpret_cast<unsigned long>(&buffers[slot]);
+            sqe->statx_flags = 0;
+            sqe->user_data = slot;
+            sqArray[index] = index;
+
+            tail++;
+            next++;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+        unsigned int toSubmit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sys_io_uring_enter(m_ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS) == -1)
+        {
+            // These are transient; anything else means the ring is unusable.
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+
+            PERROR("io_uring_enter");
+
+            // The kernel may still write into the buffers (and read the paths) for requests it
+            // has taken off the ring, and closing the ring doesn't wait for them, so wait here.
+            // Requests it hasn't taken yet never will be once the ring is torn down.
+            auto inFlight = [&]()
+            {
+                return (next - completed) - (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE));
+            };
+            for (unsigned int failures = 0; inFlight() > 0 && failures < s_maxDrainFailures; )
+            {
+                if (sys_io_uring_enter(m_ringFd, 0, 1, IORING_ENTER_GETEVENTS) == -1
+                        && errno != EINTR)
+                {
+                    failures++;
+                }
+                reap();
+            }
+            if (inFlight() > 0)
+            {
+                // Better to leak the buffers than have the kernel write into freed memory.
+                ERROR("io_uring requests still in flight; leaking their buffers");
+                buffers.release();
+            }
+            return false;
+        }
+
+        reap();
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void BatchStat::StatBatchEntries()
+{
+    const vector<string>& paths = *m_paths;
+    vector<StatResult>& results = *m_results;
+
+    size_t i;
+    while ((i = m_next++) < paths.size())
+    {
+        results[i].error = (stat(paths[i].c_str(), &results[i].st) == -1) ? errno : 0;
+    }
+}
+
+void BatchStat::Worker()
+{
+    unsigned long long seen = 0;
+    unique_lock<mutex> lock(m_lock);
+    for (;;)
+    {
+        m_wake.wait(lock, [this, seen]() { return m_stop || m_generation != seen; });
+        if (m_stop)
+            return;
+
+        seen = m_generation;
+        lock.unlock();
+
+        StatBatchEntries();
+
+        lock.lock();
+        if (--m_busy == 0)
+            m_done.notify_all();
+    }
+}
+
+void BatchStat::StatWithThreads(const vector<string>& paths, vector<StatResult>& results)
+{
+    unique_lock<mutex> lock(m_lock);
+
+    // This thread does its share too.
+    size_t numThreads = min(m_depth, s_maxThreads) - 1;
+    while (m_threads.size() < numThreads)
+    {
+        m_threads.emplace_back([this]() { Worker(); });
+    }
+
+    m_paths = &paths;
+    m_results = &results;
+    m_next = 0;
+    m_busy = m_threads.size();
+    m_generation++;
+    lock.unlock();
+    m_wake.notify_all();
+
+    StatBatchEntries();
+
+    // The workers still hold references to the batch until they've all checked in.
+    lock.lock();
+    m_done.wait(lock, [this]() { return m_busy == 0; });
+    m_paths = nullptr;
+    m_results = nullptr;
+}
+
+void BatchStat::Stat(const vector<string>& paths, vector<StatResult>& results)
+{
+    results.resize(paths.size());
+
+    if (paths.empty())
+        return;
+
+    if (m_method == Method::Auto)
+    {
+        if (StatWithRing(paths, results))
+            return;
+
+        WARN("io_uring failed; falling back to threads");
+        TeardownRing();
+        m_method = Method::Threads;
+    }
+
+    if (m_method == Method::Threads && paths.size() >= s_minThreadedBatch)
+    {
+        StatWithThreads(paths, results);
+    }
+    else
+    {
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            results[i].error = (stat(paths[i].c_str(), &results[i].st) == -1) ? errno : 0;
+        }
+    }
+}
@@ -0,0 +1,85 @@
+//
+// MusicFS :: Batched stat() Engine
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+struct StatResult
+{
+    int error; // errno value, or 0 on success
+    struct stat st;
+};
+
+// Stats many files at once, keeping many requests in flight, which matters a lot on
+// high-latency storage like network filesystems. Uses io_uring where the kernel supports it, and
+// otherwise a pool of threads doing ordinary stat() calls, which is started on first use and kept
+// until this is destroyed. Symlinks are followed.
+class BatchStat
+{
+public:
+    enum class Method
+    {
+        Auto,       // io_uring if available, otherwise threads
+        Threads,
+        Sync,       // one at a time, for comparison
+    };
+
+    BatchStat(Method method = Method::Auto, unsigned int depth = 256);
+    ~BatchStat();
+
+    BatchStat(const BatchStat&) = delete;
+    BatchStat& operator=(const BatchStat&) = delete;
+
+    // Fills results with one entry per path, in the same order.
+    void Stat(const std::vector<std::string>& paths, std::vector<StatResult>& results);
+
+    // Which method ended up being used, for logging.
+    const char *GetMethodName() const;
+
+private:
+    bool SetupRing();
+    void TeardownRing();
+    bool StatWithRing(const std::vector<std::string>& paths, std::vector<StatResult>& results);
+    void StatWithThreads(const std::vector<std::string>& paths, std::vector<StatResult>& results);
+    void StatBatchEntries();
+    void Worker();
+
+    Method m_method;
+    unsigned int m_depth;
+
+    // io_uring state, if it's in use.
+    int m_ringFd;
+    void *m_sqRing;
+    void *m_cqRing;
+    void *m_sqes;
+    size_t m_sqRingSize;
+    size_t m_cqRingSize;
+    size_t m_sqesSize;
+    unsigned int m_sqEntries;
+    unsigned int m_sqOffHead, m_sqOffTail, m_sqOffMask, m_sqOffArray;
+    unsigned int m_cqOffHead, m_cqOffTail, m_cqOffMask, m_cqOffCqes;
+
+    // Thread pool state, if it's in use. The batch being worked on is published under the lock
+    // by bumping the generation; workers then claim its entries through m_next.
+    std::vector<std::thread> m_threads;
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    bool m_stop;
+    unsigned long long m_generation;
+    size_t m_busy;
+    const std::vector<std::string> *m_paths;
+    std::vector<StatResult> *m_results;
+    std::atomic<size_t> m_next;
+};
@@ -0,0 +1,378 @@
+//
+// MusicFS :: Persistent Block Cache on Local Storage
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MUSICFS_LOG_SUBSYS "BlockCache"
+#include "logging.h"
+
+#include "block_cache.h"
+
+using namespace std;
+
+// Blocks are big enough that a miss fetches a useful amount of a track at once, and small enough
+// that a tag reader probing a few KB doesn't fetch too much more.
+static const size_t s_blockSize = 256 * 1024;
+
+// Each slot in the cache file is a header followed by a block. The header gets a whole page, so
+// blocks stay page-aligned.
+static const size_t s_headerSize = 4096;
+static const size_t s_slotSize = s_headerSize + s_blockSize;
+
+static const uint64_t s_magic = 0x4d46534243414348ull; // "MFSBCACH"
+
+struct SlotHeader
+{
+    uint64_t magic;
+    uint64_t key;
+    int64_t mtime;
+    int64_t file_size;
+    uint64_t length;
+    uint64_t checksum;
+};
+
+static uint64_t block_key(int file_id, int64_t block)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(file_id)) << 32) | static_cast<uint32_t>(block);
+}
+
+// FNV-1a. Catches blocks whose writing was cut short by a crash.
+static uint64_t checksum(const char *data, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+BlockCache::BlockCache(const string& path, unsigned long long capacity_bytes)
+    : m_path(path)
+    , m_fd(-1)
+    , m_slots(capacity_bytes / s_blockSize)
+    , m_hits(0)
+    , m_misses(0)
+    , m_hitBytes(0)
+    , m_missBytes(0)
+    , m_fetchedBytes(0)
+    , m_evictions(0)
+    , m_invalidations(0)
+    , m_errors(0)
+{
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (m_fd == -1)
+    {
+        PERROR("Failed to open block cache file \"" << path << "\"");
+        throw new exception();
+    }
+
+    Load();
+}
+
+BlockCache::~BlockCache()
+{
+    close(m_fd);
+}
+
+void BlockCache::Load()
+{
+    struct stat st;
+    if (fstat(m_fd, &st) == -1)
+    {
+        PERROR("fstat(" << m_path << ")");
+        throw new exception();
+    }
+
+    // The last slot in the file may only be as long as its block.
+    size_t existing = min(static_cast<size_t>((st.st_size + s_slotSize - 1) / s_slotSize), m_slots.size());
+    for (size_t i = 0; i < m_slots.size(); i++)
+    {
+        Slot& slot = m_slots[i];
+        slot.indexed = false;
+        slot.pins = 0;
+
+        SlotHeader header = {};
+        if (i < existing
+            && pread(m_fd, &header, sizeof(header), i * s_slotSize) == sizeof(header)
+            && header.magic == s_magic
+            && header.length <= s_blockSize
+            && m_index.count(header.key) == 0)
+        {
+            slot.key = header.key;
+            slot.mtime = header.mtime;
+            slot.file_size = header.file_size;
+            slot.length = header.length;
+            slot.indexed = true;
+            m_lru.push_back(i);
+            slot.lru_pos = prev(m_lru.end());
+            m_index[slot.key] = i;
+        }
+        else
+        {
+            m_free.push_back(i);
+        }
+    }
+
+    // The configured size may have shrunk since last time.
+    if (static_cast<unsigned long long>(st.st_size) > m_slots.size() * s_slotSize)
+    {
+        if (ftruncate(m_fd, m_slots.size() * s_slotSize) == -1)
+            PERROR("ftruncate(" << m_path << ")");
+    }
+
+    // Hand out free slots from the start of the file, so it only grows as far as it needs to.
+    reverse(m_free.begin(), m_free.end());
+
+    INFO("Block cache has " << m_index.size() << " of " << m_slots.size() << " blocks in use.");
+}
+
+ssize_t BlockCache::Read(int file_id, time_t mtime, off_t file_size, char *buf, size_t size,
+    off_t offset, const Reader& readBacking)
+{
+    vector<char> data(s_blockSize);
+    size_t done = 0;
+    while (done < size && offset + static_cast<off_t>(done) < file_size)
+    {
+        off_t pos = offset + done;
+        int64_t block = pos / s_blockSize;
+        size_t inBlock = pos % s_blockSize;
+        uint64_t key = block_key(file_id, block);
+
+        ssize_t length = Lookup(key, mtime, file_size, data);
+        bool hit = (length != -1);
+        if (!hit)
+        {
+            size_t filled = 0;
+            while (filled < s_blockSize)
+            {
+                ssize_t n = readBacking(data.data() + filled, s_blockSize - filled, block * s_blockSize + filled);
+                if (n == -1)
+                {
+                    if (done == 0)
+                        return -1;
+                    return done;
+                }
+                if (n == 0)
+                    break;
+                filled += n;
+            }
+            length = filled;
+
+            // Don't cache a short block unless it's the end of the file; it'd be wrong later.
+            if (filled == s_blockSize || static_cast<off_t>(block * s_blockSize + filled) == file_size)
+                Store(key, mtime, file_size, data, filled);
+        }
+
+        size_t n = 0;
+        if (static_cast<size_t>(length) > inBlock)
+        {
+            n = min(size - done, length - inBlock);
+            memcpy(buf + done, data.data() + inBlock, n);
+            done += n;
+        }
+
+        {
+            lock_guard<mutex> lock(m_lock);
+            if (hit)
+            {
+                m_hits++;
+                m_hitBytes += n;
+            }
+            else
+            {
+                m_misses++;
+                m_missBytes += n;
+                m_fetchedBytes += length;
+            }
+        }
+
+        if (static_cast<size_t>(length) < s_blockSize)
+            break;
+    }
+    return done;
+}
+
+ssize_t BlockCache::Lookup(uint64_t key, time_t mtime, off_t file_size, vector<char>& data)
+{
+    size_t slot;
+    size_t length;
+    {
+        lock_guard<mutex> lock(m_lock);
+        auto found = m_index.find(key);
+        if (found == m_index.end())
+            return -1;
+
+        slot = found->second;
+        Slot& s = m_slots[slot];
+        if (s.mtime != mtime || s.file_size != file_size)
+        {
+            // The file has changed since this was cached.
+            Unindex(slot);
+            m_invalidations++;
+            return -1;
+        }
+
+        m_lru.splice(m_lru.begin(), m_lru, s.lru_pos);
+        s.pins++;
+        length = s.length;
+    }
+
+    // Read the header again, along with the data, to check it against the checksum. The slot is
+    // pinned, so it won't be reused meanwhile.
+    vector<char> raw(s_headerSize + length);
+    ssize_t n = pread(m_fd, raw.data(), raw.size(), slot * s_slotSize);
+
+    SlotHeader header;
+    memcpy(&header, raw.data(), sizeof(header));
+    bool ok = (n == static_cast<ssize_t>(raw.size())
+        && header.magic == s_magic
+        && header.key == key
+        && header.length == length
+        && header.checksum == checksum(raw.data() + s_headerSize, length));
+    if (ok)
+        memcpy(data.data(), raw.data() + s_headerSize, length);
+
+    lock_guard<mutex> lock(m_lock);
+    Slot& s = m_slots[slot];
+    if (!ok)
+    {
+        if (n == -1)
+            PERROR("pread(" << m_path << ")");
+        else
+            ERROR("block " << slot << " of the cache is corrupt");
+        m_errors++;
+        if (s.indexed)
+            Unindex(slot);
+        Unpin(slot);
+        return -1;
+    }
+
+    Unpin(slot);
+    return length;
+}
+
+void BlockCache::Store(uint64_t key, time_t mtime, off_t file_size, const vector<char>& data, size_t length)
+{
+    size_t slot;
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (m_slots.empty() || m_index.count(key) != 0)
+            return;
+
+        if (!m_free.empty())
+        {
+            slot = m_free.back();
+            m_free.pop_back();
+        }
+        else
+        {
+            // Evict the least recently used block nobody's reading.
+            auto victim = find_if(m_lru.rbegin(), m_lru.rend(),
+                [this](size_t i) { return m_slots[i].pins == 0; });
+            if (victim == m_lru.rend())
+                return;
+
+            slot = *victim;
+            m_index.erase(m_slots[slot].key);
+            m_lru.erase(m_slots[slot].lru_pos);
+            m_slots[slot].indexed = false;
+            m_evictions++;
+        }
+
+        Slot& s = m_slots[slot];
+        s.key = key;
+        s.mtime = mtime;
+        s.file_size = file_size;
+        s.length = length;
+        s.pins = 1;
+    }
+
+    vector<char> raw(s_headerSize + length);
+    SlotHeader header = {};
+    header.magic = s_magic;
+    header.key = key;
+    header.mtime = mtime;
+    header.file_size = file_size;
+    header.length = length;
+    header.checksum = checksum(data.data(), length);
+    memcpy(raw.data(), &header, sizeof(header));
+    memcpy(raw.data() + s_headerSize, data.data(), length);
+
+    bool ok = (pwrite(m_fd, raw.data(), raw.size(), slot * s_slotSize) == static_cast<ssize_t>(raw.size()));
+
+    lock_guard<mutex> lock(m_lock);
+    Slot& s = m_slots[slot];
+    if (!ok)
+    {
+        PERROR("pwrite(" << m_path << ")");
+        m_errors++;
+    }
+    else if (m_index.count(key) == 0)
+    {
+        s.indexed = true;
+        m_lru.push_front(slot);
+        s.lru_pos = m_lru.begin();
+        m_index[key] = slot;
+    }
+    Unpin(slot);
+}
+
+void BlockCache::Unindex(size_t slot)
+{
+    Slot& s = m_slots[slot];
+    m_index.erase(s.key);
+    m_lru.erase(s.lru_pos);
+    s.indexed = false;
+    if (s.pins == 0)
+        m_free.push_back(slot);
+}
+
+void BlockCache::Unpin(size_t slot)
+{
+    Slot& s = m_slots[slot];
+    if (--s.pins == 0 && !s.indexed)
+        m_free.push_back(slot);
+}
+
+string BlockCache::GetState() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    unsigned long long total = m_hitBytes + m_missBytes;
+
+    stringstream ss;
+    ss << "path: " << m_path << "\n"
+        << "block_size: " << s_blockSize << "\n"
+        << "blocks: " << m_slots.size() << "\n"
+        << "blocks_used: " << m_index.size() << "\n"
+        << "hits: " << m_hits << "\n"
+        << "misses: " << m_misses << "\n"
+        << "hit_bytes: " << m_hitBytes << "\n"
+        << "miss_bytes: " << m_missBytes << "\n"
+        << "fetched_bytes: " << m_fetchedBytes << "\n"
+        << "byte_hit_rate: " << (total == 0 ? 0.0 : static_cast<double>(m_hitBytes) / total) << "\n"
+        << "evictions: " << m_evictions << "\n"
+        << "invalidations: " << m_invalidations << "\n"
+        << "errors: " << m_errors << "\n";
+    return ss.str();
+}
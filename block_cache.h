@@ -0,0 +1,81 @@
+//
+// MusicFS :: Persistent Block Cache on Local Storage
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Keeps copies of blocks of backing files in one big file on fast local storage (an SSD, say),
+// for when the backing FS is slow or remote. Blocks are keyed by file ID and index, and tagged
+// with the file's mtime and size as recorded in the database, so when a file changes, its old
+// blocks stop matching. Least recently used blocks are replaced once the cache is full. The cache
+// survives restarts: each block carries its own key and a checksum, and the index is rebuilt
+// from them when the cache is opened.
+class BlockCache
+{
+public:
+    // Reads the backing file like pread.
+    typedef std::function<ssize_t(char *buf, size_t size, off_t offset)> Reader;
+
+    BlockCache(const std::string& path, unsigned long long capacity_bytes);
+    ~BlockCache();
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    // Like pread, for the given file, which has the given mtime and size. Blocks that aren't
+    // cached are read in full with readBacking, and stored.
+    ssize_t Read(int file_id, time_t mtime, off_t file_size, char *buf, size_t size, off_t offset,
+        const Reader& readBacking);
+
+    std::string GetState() const;
+
+private:
+    struct Slot
+    {
+        uint64_t key;
+        time_t mtime;
+        off_t file_size;
+        size_t length;
+        bool indexed;       // in m_index; otherwise free, or being filled
+        unsigned int pins;  // readers and writers using the slot right now
+        std::list<size_t>::iterator lru_pos; // valid when indexed
+    };
+
+    void Load();
+
+    // Copies a block into data and returns its length, or -1 if it isn't cached.
+    ssize_t Lookup(uint64_t key, time_t mtime, off_t file_size, std::vector<char>& data);
+    void Store(uint64_t key, time_t mtime, off_t file_size, const std::vector<char>& data, size_t length);
+
+    // Called with m_lock held.
+    void Unindex(size_t slot);
+    void Unpin(size_t slot);
+
+    const std::string m_path;
+    int m_fd;
+
+    mutable std::mutex m_lock;
+    std::vector<Slot> m_slots;
+    std::unordered_map<uint64_t, size_t> m_index;   // key to slot
+    std::list<size_t> m_lru;                        // indexed slots, most recently used first
+    std::vector<size_t> m_free;
+
+    unsigned long long m_hits;
+    unsigned long long m_misses;
+    unsigned long long m_hitBytes;      // read from the cache
+    unsigned long long m_missBytes;     // read from blocks that weren't cached
+    unsigned long long m_fetchedBytes;  // read from the backing FS to fill the cache
+    unsigned long long m_evictions;
+    unsigned long long m_invalidations;
+    unsigned long long m_errors;
+};
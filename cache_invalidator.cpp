@@ -0,0 +1,269 @@
+//
+// MusicFS :: Invalidation of the Kernel's Caches When the Tree Changes
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MUSICFS_LOG_SUBSYS "CacheInvalidator"
+#include "logging.h"
+
+#include "database.h"
+#include "lookup_filter.h"
+#include "cache_invalidator.h"
+
+using namespace std;
+
+// How often to check for changes made by other processes.
+static const chrono::seconds s_pollInterval(1);
+
+CacheInvalidator::CacheInvalidator(
+    const MusicDatabase& db,
+    const EntryInvalidator& invalidateEntry,
+    const InodeInvalidator& invalidateInode,
+    LookupFilter *lookupFilter
+    )
+    : m_db(db)
+    , m_invalidateEntry(invalidateEntry)
+    , m_invalidateInode(invalidateInode)
+    , m_lookupFilter(lookupFilter)
+    , m_dataVersion(0)
+    , m_lastChange(0)
+    , m_stop(false)
+    , m_requested(0)
+    , m_completed(0)
+    , m_changes(0)
+    , m_resyncs(0)
+    , m_entries(0)
+    , m_inodes(0)
+    , m_errors(0)
+{
+}
+
+CacheInvalidator::~CacheInvalidator()
+{
+    Stop();
+}
+
+void CacheInvalidator::Start()
+{
+    lock_guard<mutex> lock(m_lock);
+    if (!m_thread.joinable())
+    {
+        m_thread = thread([this]() { Run(); });
+    }
+}
+
+void CacheInvalidator::Stop()
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    m_done.notify_all();
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+}
+
+void CacheInvalidator::Request()
+{
+    lock_guard<mutex> lock(m_lock);
+    if (!m_thread.joinable() || m_stop)
+        return;
+
+    ++m_requested;
+    m_wake.notify_all();
+}
+
+void CacheInvalidator::Sync()
+{
+    unique_lock<mutex> lock(m_lock);
+    if (!m_thread.joinable() || m_stop)
+        return;
+
+    unsigned long long request = ++m_requested;
+    m_wake.notify_all();
+    m_done.wait(lock, [this, request]() { return m_stop || m_completed >= request; });
+}
+
+void CacheInvalidator::Run()
+{
+    try
+    {
+        // Note the version first, so changes made in between are read.
+        m_dataVersion = m_db.GetDataVersion();
+        m_lastChange = m_db.GetLastPathChange();
+    }
+    catch (exception *)
+    {
+        // Everything recorded so far gets invalidated, which is harmless.
+        ERROR("Failed to find the last change to the database.");
+    }
+
+    unique_lock<mutex> lock(m_lock);
+    while (!m_stop)
+    {
+        m_wake.wait_for(lock, s_pollInterval, [this]() { return m_stop || m_requested != m_completed; });
+        if (m_stop)
+            break;
+
+        unsigned long long request = m_requested;
+        bool forced = (request != m_completed);
+        lock.unlock();
+
+        bool changed = forced;
+        if (!changed)
+        {
+            try
+            {
+                changed = (m_db.GetDataVersion() != m_dataVersion);
+            }
+            catch (exception *)
+            {
+                ERROR("Failed to check the database for changes.");
+            }
+        }
+
+        vector<PathChange> changes;
+        if (changed && ReadChanges(changes) && !changes.empty())
+        {
+            // Updated after reading the changes, so it has at least every name about to be
+            // announced.
+            if (m_lookupFilter != nullptr)
+            {
+                try
+                {
+                    m_lookupFilter->Update();
+                }
+                catch (exception *)
+                {
+                    // It's left invalid, so the next lookup tries again.
+                    ERROR("Failed to update the lookup filter.");
+                }
+            }
+
+            Invalidate(changes);
+        }
+
+        lock.lock();
+        m_completed = request;
+        m_done.notify_all();
+    }
+}
+
+bool CacheInvalidator::ReadChanges(vector<PathChange>& changes)
+{
+    bool complete = true;
+    int lastChange = m_lastChange;
+    try
+    {
+        // Note the version first, so changes made while reading are read next time.
+        m_dataVersion = m_db.GetDataVersion();
+
+        complete = m_db.ForEachPathChange(lastChange,
+            [&changes, &lastChange](int id, int path_id, int parent_id, const string& name, bool entry)
+            {
+                lastChange = id;
+                changes.push_back(PathChange{ path_id, parent_id, name, entry });
+            });
+
+        if (!complete)
+        {
+            // Too long since the last look; all that can be done is to invalidate every path
+            // there is now. Names that were removed in the meantime stay cached until they time
+            // out.
+            WARN("Missed some changes to the database; invalidating every path.");
+            changes.clear();
+            lastChange = m_db.GetLastPathChange();
+            m_db.ForEachPath([&changes](int path_id, int parent_id, const string& name, int,
+                    const struct stat&)
+                {
+                    changes.push_back(PathChange{ path_id, parent_id, name, true });
+                });
+        }
+    }
+    catch (exception *)
+    {
+        ERROR("Failed to read changes from the database.");
+        lock_guard<mutex> lock(m_lock);
+        m_errors++;
+        return false;
+    }
+
+    m_lastChange = lastChange;
+
+    lock_guard<mutex> lock(m_lock);
+    m_changes += changes.size();
+    if (!complete)
+        m_resyncs++;
+    return true;
+}
+
+void CacheInvalidator::Invalidate(const vector<PathChange>& changes)
+{
+    unsigned long long entries = 0;
+    unsigned long long inodes = 0;
+    unsigned long long errors = 0;
+
+    // The kernel not having something cached isn't an error.
+    auto check = [&errors](int result, unsigned long long& count)
+    {
+        if (result == 0)
+            count++;
+        else if (result != -ENOENT)
+            errors++;
+    };
+
+    // A path usually changes more than once in a scan, e.g. removed from one album and added to
+    // another, but only needs invalidating once. Its inode is invalidated along with its name,
+    // since a removed path's ID may be reused later.
+    set<pair<int, string>> names;
+    unordered_set<int> ids;
+    for (const PathChange& change : changes)
+    {
+        if (change.entry && names.emplace(change.parent_id, change.name).second)
+            check(m_invalidateEntry(change.parent_id, change.name), entries);
+        if (ids.insert(change.path_id).second)
+            check(m_invalidateInode(change.path_id), inodes);
+    }
+
+    DEBUG("Invalidated " << entries << " names and " << inodes << " inodes.");
+
+    lock_guard<mutex> lock(m_lock);
+    m_entries += entries;
+    m_inodes += inodes;
+    m_errors += errors;
+}
+
+string CacheInvalidator::GetState() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    stringstream ss;
+    ss << "changes: " << m_changes << "\n"
+        << "resyncs: " << m_resyncs << "\n"
+        << "entries_invalidated: " << m_entries << "\n"
+        << "inodes_invalidated: " << m_inodes << "\n"
+        << "errors: " << m_errors << "\n";
+    return ss.str();
+}
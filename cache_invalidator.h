@@ -0,0 +1,97 @@
+//
+// MusicFS :: Invalidation of the Kernel's Caches When the Tree Changes
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MusicDatabase;
+class LookupFilter;
+
+// The tree only changes when the database does, so the kernel can cache names, attributes and
+// file contents for a long time, as long as it's told when they change. The database records
+// each change to the paths, whichever connection (or process) makes it, so whenever the database
+// changes, this reads the changes made since it last looked, and invalidates exactly the names
+// and inodes they touched. The lookup filter, if there is one, is brought up to date first, so
+// the kernel doesn't look up a new name only to have it rejected by a stale filter, and then
+// cache that it doesn't exist.
+class CacheInvalidator
+{
+public:
+    // Tell the kernel to forget a name in a directory, or an inode's attributes and contents.
+    // Return 0 or a negative errno, like fuse_lowlevel_notify_inval_*.
+    typedef std::function<int(int parent_id, const std::string& name)> EntryInvalidator;
+    typedef std::function<int(int path_id)> InodeInvalidator;
+
+    CacheInvalidator(
+        const MusicDatabase& db,
+        const EntryInvalidator& invalidateEntry,
+        const InodeInvalidator& invalidateInode,
+        LookupFilter *lookupFilter
+        );
+    ~CacheInvalidator();
+
+    CacheInvalidator(const CacheInvalidator&) = delete;
+    CacheInvalidator& operator=(const CacheInvalidator&) = delete;
+
+    // Starts watching for changes. The kernel mustn't be notified from within a request that
+    // might be holding the locks it needs, so this happens on a thread of its own, which has to
+    // be started after the process daemonizes.
+    void Start();
+    void Stop();
+
+    // Checks for changes now, and waits until the kernel has been told about them. Call after
+    // changing the paths with another connection.
+    void Sync();
+
+    // Like Sync, but doesn't wait. The kernel may be waiting on the request being handled for a
+    // lock it needs to take to forget a name, so this is what to use from within one.
+    void Request();
+
+    std::string GetState() const;
+
+private:
+    struct PathChange
+    {
+        int path_id;
+        int parent_id;
+        std::string name;
+        bool entry;     // the name was added or removed, rather than just the file changing
+    };
+
+    void Run();
+    // Reads the changes since the last call. Returns false if they couldn't be read.
+    bool ReadChanges(std::vector<PathChange>& changes);
+    void Invalidate(const std::vector<PathChange>& changes);
+
+    const MusicDatabase& m_db;
+    const EntryInvalidator m_invalidateEntry;
+    const InodeInvalidator m_invalidateInode;
+    LookupFilter *m_lookupFilter;
+
+    // Used only by the thread, once it's started.
+    int m_dataVersion;
+    int m_lastChange;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::thread m_thread;
+    bool m_stop;
+    unsigned long long m_requested;
+    unsigned long long m_completed;
+
+    unsigned long long m_changes;
+    unsigned long long m_resyncs;   // times it missed changes and invalidated everything
+    unsigned long long m_entries;
+    unsigned long long m_inodes;
+    unsigned long long m_errors;
+};
@@ -5,6 +5,7 @@
 //
 
 #include <algorithm>
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -17,6 +18,8 @@
 #include <vector>
 
 #include <assert.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include <sqlite3.h>
 
@@ -39,6 +42,9 @@ using namespace std;
         } \
     } while(0)
 
+// How long to wait for another connection to release its lock before failing with SQLITE_BUSY.
+static const int s_busyTimeoutMs = 10000;
+
 static string s_tableStatements[] =
 {
     // ON DELETE RESTRICT: referenced table's rows can't be deleted if references to them exist.
@@ -60,6 +66,9 @@ static string s_tableStatements[] =
         "FOREIGN KEY(albumartist_id) REFERENCES artist(id)  ON DELETE RESTRICT, "
         "FOREIGN KEY(album_id)       REFERENCES album(id)   ON DELETE RESTRICT "
         ");",
+    "CREATE INDEX IF NOT EXISTS track_artist ON track (artist_id);",
+    "CREATE INDEX IF NOT EXISTS track_albumartist ON track (albumartist_id);",
+    "CREATE INDEX IF NOT EXISTS track_album ON track (album_id);",
     "CREATE TABLE IF NOT EXISTS file ( "
         "id             INTEGER PRIMARY KEY, "
         "track_id       INTEGER NOT NULL, "
@@ -67,6 +76,8 @@ static string s_tableStatements[] =
         "mtime          TEXT    NOT NULL, "
         "FOREIGN KEY(track_id)      REFERENCES track(id)    ON DELETE RESTRICT "
         ");",
+    "CREATE INDEX IF NOT EXISTS file_path ON file (path);",
+    "CREATE INDEX IF NOT EXISTS file_track ON file (track_id);",
     "CREATE TABLE IF NOT EXISTS path ( "
         "id             INTEGER PRIMARY KEY, "
         "path           TEXT    NOT NULL UNIQUE ON CONFLICT IGNORE, "
@@ -76,9 +87,71 @@ static string s_tableStatements[] =
         "FOREIGN KEY(track_id)      REFERENCES track(id)    ON DELETE CASCADE, "
         "FOREIGN KEY(file_id)       REFERENCES file(id)     ON DELETE CASCADE, "
         "FOREIGN KEY(parent_id)     REFERENCES path(id)     ON DELETE CASCADE "
+        ");",
+    "CREATE INDEX IF NOT EXISTS path_parent ON path (parent_id);",
+    // Backing directories seen by the last grovel. Paths are relative to the backing FS path, like
+    // file.path. An mtime of zero means the directory must be re-listed next time.
+    "CREATE TABLE IF NOT EXISTS directory ( "
+        "id             INTEGER PRIMARY KEY, "
+        "path           TEXT    NOT NULL UNIQUE, "
+        "mtime          INTEGER NOT NULL, "
+        "entry_count    INTEGER NOT NULL "
+        ");",
+    // Miscellaneous facts about the library, like where the backing FS was last time.
+    "CREATE TABLE IF NOT EXISTS setting ( "
+        "name           TEXT    PRIMARY KEY, "
+        "value          TEXT    NOT NULL "
         ");"
 };
 
+// Changes to the tables above, applied in order to bring older databases up to date. The number
+// applied so far is kept in the database's user_version.
+static const char *s_migrations[] =
+{
+    // 1: Keep the file attributes getattr needs, so it doesn't have to stat the backing file. A
+    // size of -1 means unknown. Re-list every directory, so the next scan fills them in.
+    "ALTER TABLE file ADD COLUMN size INTEGER NOT NULL DEFAULT -1; "
+    "ALTER TABLE file ADD COLUMN mode INTEGER NOT NULL DEFAULT 0; "
+    "UPDATE directory SET mtime = 0;",
+
+    // 2: Record changes to the paths, so the filesystem can tell the kernel about just those. A
+    // change to a name (entry = 1) is recorded as the path being removed and/or added; a change
+    // to a file's attributes only by its paths (entry = 0). Rows are kept for a minute, which is
+    // plenty for a mounted filesystem to read them; one that misses some starts over from the
+    // path table. Also index paths by file, which this and removing files need.
+    "CREATE INDEX IF NOT EXISTS path_file ON path (file_id); "
+    "CREATE TABLE path_change ( "
+        "id             INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "path_id        INTEGER NOT NULL, "
+        "parent_id      INTEGER, "
+        "path           TEXT    NOT NULL, "
+        "entry          INTEGER NOT NULL, "
+        "time           INTEGER NOT NULL DEFAULT (CAST(strftime('%s', 'now') AS INTEGER)) "
+        "); "
+    "CREATE INDEX path_change_time ON path_change (time); "
+    "CREATE TRIGGER path_added AFTER INSERT ON path BEGIN "
+        "INSERT INTO path_change (path_id, parent_id, path, entry) "
+            "VALUES (NEW.id, NEW.parent_id, NEW.path, 1); "
+        "END; "
+    "CREATE TRIGGER path_removed AFTER DELETE ON path BEGIN "
+        "INSERT INTO path_change (path_id, parent_id, path, entry) "
+            "VALUES (OLD.id, OLD.parent_id, OLD.path, 1); "
+        "END; "
+    "CREATE TRIGGER path_changed AFTER UPDATE OF path, parent_id, file_id ON path BEGIN "
+        "INSERT INTO path_change (path_id, parent_id, path, entry) "
+            "VALUES (OLD.id, OLD.parent_id, OLD.path, 1), (NEW.id, NEW.parent_id, NEW.path, 1); "
+        "END; "
+    "CREATE TRIGGER file_changed AFTER UPDATE OF mtime, size, mode ON file "
+        "WHEN OLD.mtime IS NOT NEW.mtime OR OLD.size IS NOT NEW.size OR OLD.mode IS NOT NEW.mode "
+        "BEGIN "
+        "INSERT INTO path_change (path_id, parent_id, path, entry) "
+            "SELECT id, parent_id, path, 0 FROM path WHERE file_id = NEW.id; "
+        "END; "
+    "CREATE TRIGGER path_change_added AFTER INSERT ON path_change BEGIN "
+        "DELETE FROM path_change WHERE time < NEW.time - 60; "
+        "END;",
+};
+
 #ifdef REGEXP_SUPPORT
 void sql_regexp_function(sqlite3_context *dbHandle, int nArgs, sqlite3_value **args)
 {
@@ -129,12 +202,18 @@ string regex_escape(const string& s)
 #endif
 
 MusicDatabase::MusicDatabase(const string& dbPath)
+    : m_profiler(nullptr)
 {
     int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 
     CHECKERR_MSG(sqlite3_open_v2(dbPath.c_str(), &m_dbHandle, flags, nullptr),
         "Failed to open database file \"" << dbPath << "\": " << sqlite3_errmsg(m_dbHandle));
 
+    // The filesystem keeps reading from the database while a scan writes to it from another
+    // connection. With WAL, readers see the last committed state instead of getting SQLITE_BUSY.
+    sqlite3_busy_timeout(m_dbHandle, s_busyTimeoutMs);
+    CHECKERR(sqlite3_exec(m_dbHandle, "PRAGMA journal_mode = WAL;", nullptr, nullptr, nullptr));
+
     size_t numTableStatements = sizeof(s_tableStatements) / sizeof(s_tableStatements[0]);
     for (size_t i = 0, n = numTableStatements; i < n; i++)
     {
@@ -152,6 +231,32 @@ MusicDatabase::MusicDatabase(const string& dbPath)
         */
     }
 
+    int numMigrations = static_cast<int>(sizeof(s_migrations) / sizeof(s_migrations[0]));
+    if (GetVersion() < numMigrations)
+    {
+        // Another process may be opening the same database, so check the version again inside
+        // the transaction that changes it.
+        CHECKERR(sqlite3_exec(m_dbHandle, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr));
+        try
+        {
+            for (int i = GetVersion(); i < numMigrations; i++)
+            {
+                INFO("Upgrading database to version " << (i + 1));
+                CHECKERR_MSG(sqlite3_exec(m_dbHandle, s_migrations[i], nullptr, nullptr, nullptr),
+                    "Error in database migration " << (i + 1));
+
+                string pragma = "PRAGMA user_version = " + to_string(i + 1) + ";";
+                CHECKERR(sqlite3_exec(m_dbHandle, pragma.c_str(), nullptr, nullptr, nullptr));
+            }
+        }
+        catch (exception *)
+        {
+            sqlite3_exec(m_dbHandle, "ROLLBACK;", nullptr, nullptr, nullptr);
+            throw;
+        }
+        CHECKERR(sqlite3_exec(m_dbHandle, "COMMIT;", nullptr, nullptr, nullptr));
+    }
+
 #ifdef REGEXP_SUPPORT
     CHECKERR_MSG(sqlite3_create_function_v2(
         m_dbHandle,
@@ -168,6 +273,27 @@ MusicDatabase::MusicDatabase(const string& dbPath)
 #endif
 }
 
+int MusicDatabase::GetVersion() const
+{
+    const char stmt[] = "PRAGMA user_version;";
+    sqlite3_stmt *prepared;
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+
+    int version = 0;
+    int result = sqlite3_step(prepared);
+    if (result == SQLITE_ROW)
+    {
+        version = sqlite3_column_int(prepared, 0);
+    }
+    else
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+    return version;
+}
+
 MusicDatabase::~MusicDatabase()
 {
     sqlite3_close(m_dbHandle);
@@ -211,15 +337,31 @@ void MusicDatabase::ClearPaths()
         "Error clearing out path table");
 }
 
-bool MusicDatabase::GetRealPath(const string& path, string& pathOut) const
+// Fills in the file attributes from the size, mtime and mode columns starting at the given one.
+// The mode is left zero if they're unknown.
+static void column_stat(sqlite3_stmt *prepared, int column, struct stat *statOut)
+{
+    if (statOut == nullptr)
+        return;
+
+    memset(statOut, 0, sizeof(*statOut));
+    if (sqlite3_column_type(prepared, column) == SQLITE_NULL || sqlite3_column_int64(prepared, column) < 0)
+        return;
+
+    statOut->st_size = sqlite3_column_int64(prepared, column);
+    statOut->st_mtime = sqlite3_column_int64(prepared, column + 1);
+    statOut->st_mode = sqlite3_column_int(prepared, column + 2);
+}
+
+bool MusicDatabase::GetRealPath(int path_id, string& pathOut, struct stat *statOut) const
 {
-    const char stmt[] = "SELECT file.path FROM path "
+    const char stmt[] = "SELECT file.path, file.size, file.mtime, file.mode FROM path "
         "LEFT JOIN file ON file.id = path.file_id "
-        "WHERE path.path = ?;";
+        "WHERE path.id = ?;";
 
     sqlite3_stmt *prepared;
     CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
-    CHECKERR(sqlite3_bind_text(prepared, 1, path.c_str(), path.size(), nullptr));
+    CHECKERR(sqlite3_bind_int(prepared, 1, path_id));
 
     bool found = false;
     int result = sqlite3_step(prepared);
@@ -230,6 +372,7 @@ bool MusicDatabase::GetRealPath(const string& path, string& pathOut) const
             pathOut.clear();
         else
             pathOut = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 0));
+        column_stat(prepared, 1, statOut);
     }
     else if (result != SQLITE_DONE)
     {
@@ -240,18 +383,88 @@ bool MusicDatabase::GetRealPath(const string& path, string& pathOut) const
     return found;
 }
 
-int MusicDatabase::GetPathId(const string& path) const
+bool MusicDatabase::GetFileForPath(int path_id, int *file_id, string& pathOut, struct stat *statOut) const
 {
-    const char stmt[] = "SELECT id FROM path WHERE path = ?;";
+    const char stmt[] = "SELECT file.id, file.path, file.size, file.mtime, file.mode FROM path "
+        "LEFT JOIN file ON file.id = path.file_id "
+        "WHERE path.id = ?;";
+
     sqlite3_stmt *prepared;
     CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
-    CHECKERR(sqlite3_bind_text(prepared, 1, path.c_str(), path.size(), nullptr));
+    CHECKERR(sqlite3_bind_int(prepared, 1, path_id));
+
+    bool found = false;
+    int result = sqlite3_step(prepared);
+    if (result == SQLITE_ROW)
+    {
+        found = true;
+        if (sqlite3_column_type(prepared, 0) == SQLITE_NULL)
+        {
+            *file_id = 0;
+            pathOut.clear();
+        }
+        else
+        {
+            *file_id = sqlite3_column_int(prepared, 0);
+            pathOut = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 1));
+        }
+        column_stat(prepared, 2, statOut);
+    }
+    else if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+    return found;
+}
+
+bool MusicDatabase::GetParentOfPath(int path_id, int *parent_id) const
+{
+    const char stmt[] = "SELECT parent_id FROM path WHERE id = ?;";
+
+    sqlite3_stmt *prepared;
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    CHECKERR(sqlite3_bind_int(prepared, 1, path_id));
+
+    bool found = false;
+    int result = sqlite3_step(prepared);
+    if (result == SQLITE_ROW)
+    {
+        found = true;
+        *parent_id = sqlite3_column_int(prepared, 0); // NULL reads as zero
+    }
+    else if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+    return found;
+}
+
+int MusicDatabase::LookupPath(int parent_id, const string& name, string& pathOut, struct stat *statOut) const
+{
+    // Paths are unique, so the parent's path plus the name is enough to find it by index.
+    const char stmt[] = "SELECT path.id, file.path, file.size, file.mtime, file.mode FROM path "
+        "LEFT JOIN file ON file.id = path.file_id "
+        "WHERE path.path = coalesce((SELECT path FROM path WHERE id = ?1), '') || '/' || ?2;";
+
+    sqlite3_stmt *prepared;
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    CHECKERR(sqlite3_bind_int(prepared, 1, parent_id));
+    CHECKERR(sqlite3_bind_text(prepared, 2, name.c_str(), name.size(), nullptr));
 
     int id = 0;
     int result = sqlite3_step(prepared);
     if (result == SQLITE_ROW)
     {
         id = sqlite3_column_int(prepared, 0);
+        if (sqlite3_column_type(prepared, 1) == SQLITE_NULL)
+            pathOut.clear();
+        else
+            pathOut = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 1));
+        column_stat(prepared, 2, statOut);
     }
     else if (result != SQLITE_DONE)
     {
@@ -324,15 +537,15 @@ int MusicDatabase::AddPath(const std::string& path, int parent_id, int track_id,
     return path_id;
 }
 
-vector<string> MusicDatabase::GetChildrenOfPath(
+vector<tuple<int, string, string, struct stat>> MusicDatabase::GetChildrenOfPath(
     int parent_id,
     const function<bool(const string&, const string&)>& file_preference
     ) const
 {
-    vector<string> results;
-    unordered_map<int, vector<pair<string, string>>> files_by_track;
+    vector<tuple<int, string, string, struct stat>> results;
+    unordered_map<int, vector<tuple<string, string, int, struct stat>>> files_by_track;
 
-    string stmt = "SELECT path.path, track.id, file.path "
+    string stmt = "SELECT path.path, track.id, file.path, path.id, file.size, file.mtime, file.mode "
                     "FROM path "
                     "LEFT JOIN track ON track.id = path.track_id "
                     "LEFT JOIN file ON file.id = path.file_id "
@@ -354,20 +567,24 @@ vector<string> MusicDatabase::GetChildrenOfPath(
     {
         const char* childPath = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 0));
         int track_id = sqlite3_column_int(prepared, 1);
+        int path_id = sqlite3_column_int(prepared, 3);
         if (track_id == 0)
         {
             // Row represents a directory, not a file. Insert into result set directly.
-            results.emplace_back(childPath);
+            struct stat none = {};
+            results.emplace_back(path_id, childPath, string(), none);
         }
         else
         {
             // Row represents a track and file. Add to the map.
             const char* filePath = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 2));
+            struct stat st;
+            column_stat(prepared, 4, &st);
 
             if (files_by_track.find(track_id) == files_by_track.end())
-                files_by_track.emplace(track_id, vector<pair<string, string>>({}));
+                files_by_track.emplace(track_id, vector<tuple<string, string, int, struct stat>>({}));
 
-            files_by_track[track_id].emplace_back(filePath, childPath);
+            files_by_track[track_id].emplace_back(filePath, childPath, path_id, st);
         }
     }
     if (result != SQLITE_DONE)
@@ -379,24 +596,25 @@ vector<string> MusicDatabase::GetChildrenOfPath(
 
     for (auto& track_pair : files_by_track)
     {
-        vector<pair<string, string>>& files = track_pair.second;
-        auto pair_unpacker = [file_preference](const pair<string, string>& p1, const pair<string, string>& p2)
+        vector<tuple<string, string, int, struct stat>>& files = track_pair.second;
+        auto pair_unpacker = [file_preference](const tuple<string, string, int, struct stat>& p1, const tuple<string, string, int, struct stat>& p2)
         {
-            return file_preference(p1.first, p2.first);
+            return file_preference(get<0>(p1), get<0>(p2));
         };
         stable_sort(files.begin(), files.end(), pair_unpacker);
 
         //DEBUG
         INFO("track id: " << track_pair.first);
-        for (const auto& pair : files)
+        for (const auto& file : files)
         {
-            INFO(pair.first << " # " << pair.second);
+            INFO(get<0>(file) << " # " << get<1>(file));
         }
 
         // If the preference function prefers empty string to the best file path, that means nothing is selected.
-        if (file_preference(files.front().first, ""))
+        if (file_preference(get<0>(files.front()), ""))
         {
-            results.emplace_back(move(files.front().second));
+            auto& file = files.front();
+            results.emplace_back(get<2>(file), move(get<1>(file)), move(get<0>(file)), get<3>(file));
         }
         else
         {
@@ -438,33 +656,43 @@ void MusicDatabase::AddRow(const char *table, std::string value, int *outId)
     sqlite3_finalize(prepared);
 }
 
-void MusicDatabase::AddTrack(const MusicInfo& attributes, string path, time_t mtime, int *out_track_id, int *out_file_id)
+void MusicDatabase::AddTrack(const MusicTags& tags, string path, const struct stat& st, int *out_track_id, int *out_file_id)
 {
     DEBUG("Adding track: " << path);
 
+    int track_id = GetTrack(tags);
+    int file_id = AddFile(track_id, path, st);
+
+    if (out_file_id != nullptr)
+        *out_file_id = file_id;
+    if (out_track_id != nullptr)
+        *out_track_id = track_id;
+}
+
+int MusicDatabase::GetTrack(const MusicTags& tags)
+{
     int artistId, albumartistId, albumId;
 
-    if (!GetId("artist", attributes.artist(), &artistId))
+    if (!GetId("artist", tags.artist, &artistId))
     {
-        DEBUG("adding artist " << attributes.artist());
-        AddRow("artist", attributes.artist(), &artistId);
+        DEBUG("adding artist " << tags.artist);
+        AddRow("artist", tags.artist, &artistId);
     }
 
-    if (!GetId("artist", attributes.albumartist(), &albumartistId))
+    if (!GetId("artist", tags.albumartist, &albumartistId))
     {
-        DEBUG("adding artist " << attributes.albumartist());
-        AddRow("artist", attributes.albumartist(), &albumartistId);
+        DEBUG("adding artist " << tags.albumartist);
+        AddRow("artist", tags.albumartist, &albumartistId);
     }
 
-    if (!GetId("album", attributes.album(), &albumId))
+    if (!GetId("album", tags.album, &albumId))
     {
-        DEBUG("adding album " << attributes.album());
-        AddRow("album", attributes.album(), &albumId);
+        DEBUG("adding album " << tags.album);
+        AddRow("album", tags.album, &albumId);
     }
 
-    // Bind these to local strings so we control their lifetimes.
-    string title = attributes.title();
-    string disc = attributes.disc();
+    const string& title = tags.title;
+    const string& disc = tags.disc;
 
     const char stmt[] = "SELECT id FROM track "
                     "WHERE artist_id = ? "
@@ -481,9 +709,9 @@ void MusicDatabase::AddTrack(const MusicInfo& attributes, string path, time_t mt
         CHECKERR(sqlite3_bind_int(prepared, 1, artistId));
         CHECKERR(sqlite3_bind_int(prepared, 2, albumartistId));
         CHECKERR(sqlite3_bind_int(prepared, 3, albumId));
-        CHECKERR(sqlite3_bind_int(prepared, 4, attributes.year()));
+        CHECKERR(sqlite3_bind_int(prepared, 4, tags.year));
         CHECKERR(sqlite3_bind_text(prepared, 5, title.c_str(), title.size(), nullptr));
-        CHECKERR(sqlite3_bind_int(prepared, 6, attributes.track()));
+        CHECKERR(sqlite3_bind_int(prepared, 6, tags.track));
     };
 
     bindValues();
@@ -523,12 +751,80 @@ void MusicDatabase::AddTrack(const MusicInfo& attributes, string path, time_t mt
 
     sqlite3_finalize(prepared);
 
-    const char stmt2[] = "INSERT INTO file (track_id, path, mtime) VALUES(?,?,?);";
-    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt2, sizeof(stmt2), &prepared, nullptr));
+    return track_id;
+}
+
+int MusicDatabase::AddFile(int track_id, const string& path, const struct stat& st)
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "INSERT INTO file (track_id, path, mtime, size, mode) VALUES(?,?,?,?,?);";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
 
     CHECKERR(sqlite3_bind_int(prepared, 1, track_id));
     CHECKERR(sqlite3_bind_text(prepared, 2, path.c_str(), path.size(), nullptr));
-    CHECKERR(sqlite3_bind_int(prepared, 3, mtime));
+    CHECKERR(sqlite3_bind_int(prepared, 3, st.st_mtime));
+    CHECKERR(sqlite3_bind_int64(prepared, 4, st.st_size));
+    CHECKERR(sqlite3_bind_int(prepared, 5, st.st_mode));
+
+    int result = sqlite3_step(prepared);
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+
+    return sqlite3_last_insert_rowid(m_dbHandle);
+}
+
+void MusicDatabase::UpdateFileStat(int id, const struct stat& st)
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "UPDATE file SET mtime = ?, size = ?, mode = ? WHERE id = ?;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+
+    CHECKERR(sqlite3_bind_int(prepared, 1, st.st_mtime));
+    CHECKERR(sqlite3_bind_int64(prepared, 2, st.st_size));
+    CHECKERR(sqlite3_bind_int(prepared, 3, st.st_mode));
+    CHECKERR(sqlite3_bind_int(prepared, 4, id));
+
+    int result = sqlite3_step(prepared);
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+}
+
+int MusicDatabase::UpdateFile(int id, const MusicTags& tags, const struct stat& st)
+{
+    int track_id = GetTrack(tags);
+
+    sqlite3_stmt *prepared;
+    const char stmt[] = "UPDATE file SET track_id = ?, mtime = ?, size = ?, mode = ? WHERE id = ?;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+
+    CHECKERR(sqlite3_bind_int(prepared, 1, track_id));
+    CHECKERR(sqlite3_bind_int(prepared, 2, st.st_mtime));
+    CHECKERR(sqlite3_bind_int64(prepared, 3, st.st_size));
+    CHECKERR(sqlite3_bind_int(prepared, 4, st.st_mode));
+    CHECKERR(sqlite3_bind_int(prepared, 5, id));
+
+    int result = sqlite3_step(prepared);
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+
+    // Otherwise they'd go with the old track when CleanTracks removes it.
+    const char pathStmt[] = "UPDATE path SET track_id = ? WHERE file_id = ?;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, pathStmt, sizeof(pathStmt), &prepared, nullptr));
+
+    CHECKERR(sqlite3_bind_int(prepared, 1, track_id));
+    CHECKERR(sqlite3_bind_int(prepared, 2, id));
 
     result = sqlite3_step(prepared);
     if (result != SQLITE_DONE)
@@ -538,10 +834,24 @@ void MusicDatabase::AddTrack(const MusicInfo& attributes, string path, time_t mt
 
     sqlite3_finalize(prepared);
 
-    if (out_file_id != nullptr)
-        *out_file_id = sqlite3_last_insert_rowid(m_dbHandle);
-    if (out_track_id != nullptr)
-        *out_track_id = track_id;
+    return track_id;
+}
+
+void MusicDatabase::RemoveOtherPaths(int file_id, int path_id)
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "DELETE FROM path WHERE file_id = ? AND id != ?;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    CHECKERR(sqlite3_bind_int(prepared, 1, file_id));
+    CHECKERR(sqlite3_bind_int(prepared, 2, path_id));
+
+    int result = sqlite3_step(prepared);
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
 }
 
 void MusicDatabase::GetAttributes(int file_id, MusicAttributes& attrs) const
@@ -611,13 +921,17 @@ void MusicDatabase::CleanTable(const char *table)
         "WHERE NOT EXISTS ("
             "SELECT NULL "
             "FROM track "
-            "WHERE track." + table + "_id = " + table + ".id";
+            "WHERE track." + table + "_id = " + table + ".id)";
 
+    // Separately from the above, so each can use its index.
     if (strcmp(table, "artist") == 0)
     {
-        stmt += " OR track.albumartist_id = artist.id";
+        stmt += " AND NOT EXISTS ("
+                    "SELECT NULL "
+                    "FROM track "
+                    "WHERE track.albumartist_id = artist.id)";
     }
-    stmt += ");";
+    stmt += ";";
 
     CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt.c_str(), stmt.size(), &prepared, nullptr));
 
@@ -709,13 +1023,24 @@ void MusicDatabase::CleanTables()
     CleanTable("album");
 }
 
-vector<tuple<int, int, time_t, string>> MusicDatabase::GetFiles() const
+vector<tuple<int, int, time_t, string, off_t>> MusicDatabase::GetFiles(const string& directory) const
 {
-    vector<tuple<int, int, time_t, string>> results;
+    vector<tuple<int, int, time_t, string, off_t>> results;
 
     sqlite3_stmt *prepared;
-    const char stmt[] = "SELECT file.id, file.track_id, file.mtime, file.path FROM file;";
-    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    if (directory.empty())
+    {
+        const char stmt[] = "SELECT file.id, file.track_id, file.mtime, file.path, file.size FROM file;";
+        CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    }
+    else
+    {
+        // Everything between "<directory>/" and "<directory>0" ('0' comes right after '/').
+        const char stmt[] = "SELECT file.id, file.track_id, file.mtime, file.path, file.size FROM file "
+                            "WHERE file.path > ?1 || '/' AND file.path < ?1 || '0';";
+        CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+        CHECKERR(sqlite3_bind_text(prepared, 1, directory.c_str(), directory.size(), nullptr));
+    }
 
     int result;
     while ((result = sqlite3_step(prepared)) == SQLITE_ROW)
@@ -724,8 +1049,37 @@ vector<tuple<int, int, time_t, string>> MusicDatabase::GetFiles() const
         int track_id = sqlite3_column_int(prepared, 1);
         time_t mtime = sqlite3_column_int64(prepared, 2);
         string path = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 3));
+        off_t size = sqlite3_column_int64(prepared, 4);
+
+        results.emplace_back(id, track_id, mtime, path, size);
+    }
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+
+    return results;
+}
+
+vector<tuple<int, time_t, size_t, string>> MusicDatabase::GetDirectories() const
+{
+    vector<tuple<int, time_t, size_t, string>> results;
+
+    sqlite3_stmt *prepared;
+    const char stmt[] = "SELECT id, mtime, entry_count, path FROM directory;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+
+    int result;
+    while ((result = sqlite3_step(prepared)) == SQLITE_ROW)
+    {
+        int id = sqlite3_column_int(prepared, 0);
+        time_t mtime = sqlite3_column_int64(prepared, 1);
+        size_t entry_count = sqlite3_column_int64(prepared, 2);
+        string path = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 3));
 
-        results.emplace_back(id, track_id, mtime, path);
+        results.emplace_back(id, mtime, entry_count, path);
     }
     if (result != SQLITE_DONE)
     {
@@ -737,15 +1091,179 @@ vector<tuple<int, int, time_t, string>> MusicDatabase::GetFiles() const
     return results;
 }
 
+void MusicDatabase::SetDirectory(const string& path, time_t mtime, size_t entry_count)
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "INSERT OR REPLACE INTO directory (path, mtime, entry_count) VALUES(?,?,?);";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    CHECKERR(sqlite3_bind_text(prepared, 1, path.c_str(), path.size(), nullptr));
+    CHECKERR(sqlite3_bind_int64(prepared, 2, mtime));
+    CHECKERR(sqlite3_bind_int64(prepared, 3, entry_count));
+
+    int result = sqlite3_step(prepared);
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+}
+
+void MusicDatabase::RemoveDirectory(int id)
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "DELETE FROM directory WHERE id = ?;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    CHECKERR(sqlite3_bind_int(prepared, 1, id));
+
+    int result = sqlite3_step(prepared);
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+}
+
+void MusicDatabase::ResetDirectories()
+{
+    CHECKERR(sqlite3_exec(m_dbHandle, "UPDATE directory SET mtime = 0;", nullptr, nullptr, nullptr));
+}
+
+size_t MusicDatabase::RelocateFiles(const string& old_prefix, const string& new_prefix)
+{
+    // Directory records outside the old prefix refer to directories that aren't in the library
+    // anymore. The rest are renamed by way of a prefix no real path has, because directory paths
+    // are unique, and renaming them directly could collide with one not renamed yet (e.g. when
+    // moving "/a" to "/a/b").
+    const char *stmts[] = {
+        "DELETE FROM directory WHERE path != ?1 AND substr(path, 1, length(?1) + 1) != ?1 || '/';",
+        "UPDATE directory SET path = char(1) || substr(path, length(?1) + 1);",
+        "UPDATE directory SET path = ?2 || substr(path, 2);",
+        "UPDATE file SET path = ?2 || substr(path, length(?1) + 1) "
+            "WHERE substr(path, 1, length(?1) + 1) = ?1 || '/';",
+    };
+
+    size_t changes = 0;
+    for (const char *stmt : stmts)
+    {
+        sqlite3_stmt *prepared;
+        CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, -1, &prepared, nullptr));
+        CHECKERR(sqlite3_bind_text(prepared, 1, old_prefix.c_str(), old_prefix.size(), nullptr));
+        if (sqlite3_bind_parameter_count(prepared) > 1)
+        {
+            CHECKERR(sqlite3_bind_text(prepared, 2, new_prefix.c_str(), new_prefix.size(), nullptr));
+        }
+
+        int result = sqlite3_step(prepared);
+        if (result != SQLITE_DONE)
+        {
+            CHECKERR(result);
+        }
+
+        changes = sqlite3_changes(m_dbHandle);
+        sqlite3_finalize(prepared);
+    }
+
+    // The count from the last statement: how many files were moved.
+    return changes;
+}
+
+bool MusicDatabase::GetSetting(const string& name, string& value) const
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "SELECT value FROM setting WHERE name = ?;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    CHECKERR(sqlite3_bind_text(prepared, 1, name.c_str(), name.size(), nullptr));
+
+    bool found = false;
+    int result = sqlite3_step(prepared);
+    if (result == SQLITE_ROW)
+    {
+        value = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 0));
+        found = true;
+    }
+    else if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+
+    return found;
+}
+
+void MusicDatabase::SetSetting(const string& name, const string& value)
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "INSERT OR REPLACE INTO setting (name, value) VALUES(?,?);";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    CHECKERR(sqlite3_bind_text(prepared, 1, name.c_str(), name.size(), nullptr));
+    CHECKERR(sqlite3_bind_text(prepared, 2, value.c_str(), value.size(), nullptr));
+
+    int result = sqlite3_step(prepared);
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+}
+
+// When the statement running on this thread started. SQLite's own profile timings are only to
+// the millisecond, which is longer than most queries take.
+static thread_local chrono::steady_clock::time_point t_statementStart;
+
+void MusicDatabase::SetProfiler(Profiler profiler)
+{
+    m_profiler = profiler;
+    CHECKERR(sqlite3_trace_v2(m_dbHandle, (profiler == nullptr) ? 0 : (SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE),
+        [](unsigned type, void *context, void *, void *detail) -> int
+        {
+            auto now = chrono::steady_clock::now();
+            if (type == SQLITE_TRACE_STMT)
+            {
+                // Trigger subprograms starting are reported as comments; they're part of the
+                // statement that's already running.
+                if (strncmp(static_cast<const char*>(detail), "--", 2) != 0)
+                    t_statementStart = now;
+            }
+            else
+            {
+                static_cast<MusicDatabase*>(context)->m_profiler(
+                    chrono::duration_cast<chrono::nanoseconds>(now - t_statementStart).count());
+            }
+            return 0;
+        },
+        this));
+}
+
 void MusicDatabase::BeginTransaction()
 {
-    int result = sqlite3_exec(m_dbHandle, "BEGIN;", nullptr, nullptr, nullptr);
+    int result = sqlite3_exec(m_dbHandle, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
     if (result != SQLITE_DONE)
     {
         CHECKERR(result);
     }
 }
 
+bool MusicDatabase::TryBeginTransaction(int timeoutMs)
+{
+    sqlite3_busy_timeout(m_dbHandle, timeoutMs);
+    int result = sqlite3_exec(m_dbHandle, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+    sqlite3_busy_timeout(m_dbHandle, s_busyTimeoutMs);
+
+    if (result == SQLITE_BUSY)
+    {
+        return false;
+    }
+    else if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+    return true;
+}
+
 void MusicDatabase::EndTransaction()
 {
     int result = sqlite3_exec(m_dbHandle, "END;", nullptr, nullptr, nullptr);
@@ -754,3 +1272,144 @@ void MusicDatabase::EndTransaction()
         CHECKERR(result);
     }
 }
+
+void MusicDatabase::RollbackTransaction()
+{
+    int result = sqlite3_exec(m_dbHandle, "ROLLBACK;", nullptr, nullptr, nullptr);
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+}
+
+bool MusicDatabase::HasPaths() const
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "SELECT 1 FROM path LIMIT 1;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+
+    int result = sqlite3_step(prepared);
+    if (result != SQLITE_ROW && result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+
+    return (result == SQLITE_ROW);
+}
+
+void MusicDatabase::ForEachPath(
+    const function<void(int, int, const string&, int, const struct stat&)>& fn
+    ) const
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "SELECT path.id, path.parent_id, path.path, path.file_id, file.size, file.mtime, file.mode "
+        "FROM path LEFT JOIN file ON file.id = path.file_id;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+
+    int result;
+    while ((result = sqlite3_step(prepared)) == SQLITE_ROW)
+    {
+        // NULL parent and file IDs read as zero.
+        int path_id = sqlite3_column_int(prepared, 0);
+        int parent_id = sqlite3_column_int(prepared, 1);
+        const char *path = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 2));
+        const char *name = strrchr(path, '/');
+        int file_id = sqlite3_column_int(prepared, 3);
+        struct stat known;
+        column_stat(prepared, 4, &known);
+        fn(path_id, parent_id, (name == nullptr) ? path : name + 1, file_id, known);
+    }
+    if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+}
+
+int MusicDatabase::GetLastPathChange() const
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "SELECT max(id) FROM path_change;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+
+    int id = 0;
+    int result = sqlite3_step(prepared);
+    if (result == SQLITE_ROW)
+    {
+        id = sqlite3_column_int(prepared, 0); // NULL (no changes yet) reads as zero
+    }
+    else if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+    return id;
+}
+
+bool MusicDatabase::ForEachPathChange(
+    int after,
+    const function<void(int, int, int, const string&, bool)>& fn
+    ) const
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "SELECT id, path_id, parent_id, path, entry FROM path_change "
+        "WHERE id > ? ORDER BY id;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+    CHECKERR(sqlite3_bind_int(prepared, 1, after));
+
+    // IDs are never reused or skipped, and the newest change is never removed, so if the first
+    // one isn't the next in line, the ones in between were removed before they could be read.
+    bool complete = true;
+    int expected = after + 1;
+    int result;
+    while ((result = sqlite3_step(prepared)) == SQLITE_ROW)
+    {
+        int id = sqlite3_column_int(prepared, 0);
+        if (id != expected)
+        {
+            complete = false;
+            break;
+        }
+        expected++;
+
+        // A NULL parent ID reads as zero.
+        int path_id = sqlite3_column_int(prepared, 1);
+        int parent_id = sqlite3_column_int(prepared, 2);
+        const char *path = reinterpret_cast<const char*>(sqlite3_column_text(prepared, 3));
+        const char *name = strrchr(path, '/');
+        bool entry = (sqlite3_column_int(prepared, 4) != 0);
+        fn(id, path_id, parent_id, (name == nullptr) ? path : name + 1, entry);
+    }
+    if (result != SQLITE_DONE && result != SQLITE_ROW)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+    return complete;
+}
+
+int MusicDatabase::GetDataVersion() const
+{
+    sqlite3_stmt *prepared;
+    const char stmt[] = "PRAGMA data_version;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, stmt, sizeof(stmt), &prepared, nullptr));
+
+    int version = 0;
+    int result = sqlite3_step(prepared);
+    if (result == SQLITE_ROW)
+    {
+        version = sqlite3_column_int(prepared, 0);
+    }
+    else if (result != SQLITE_DONE)
+    {
+        CHECKERR(result);
+    }
+
+    sqlite3_finalize(prepared);
+    return version;
+}
@@ -12,8 +12,9 @@ struct MusicAttributes
 };
 
 struct sqlite3;
+struct stat;
 
-class MusicInfo;
+struct MusicTags;
 
 class MusicDatabase
 {
@@ -25,32 +26,101 @@ public:
     MusicDatabase& operator=(const MusicDatabase&) = delete;
     MusicDatabase(MusicDatabase&&) = delete;
 
-    void AddTrack(const MusicInfo& attributes, std::string filename, time_t mtime, int *out_track_id, int *out_file_id);
+    // Files are recorded with their size, mtime and mode, so getattr can be answered from here.
+    void AddTrack(const MusicTags& tags, std::string filename, const struct stat& st, int *out_track_id, int *out_file_id);
+    int AddFile(int track_id, const std::string& path, const struct stat& st);
+    void UpdateFileStat(int id, const struct stat& st);
+    // Points an existing file at the track for its new tags, along with its paths, keeping its
+    // ID. Returns the track's ID.
+    int UpdateFile(int id, const MusicTags& tags, const struct stat& st);
     void RemoveFile(int id);
-    std::vector<std::tuple<int, int, time_t, std::string>> GetFiles() const;
+    // All files, or only those under the given directory (relative to the backing FS path), as
+    // (id, track id, mtime, path, size). The size is -1 if it isn't known.
+    std::vector<std::tuple<int, int, time_t, std::string, off_t>> GetFiles(const std::string& directory = std::string()) const;
     void GetAttributes(int file_id, MusicAttributes& attributes) const;
 
+    std::vector<std::tuple<int, time_t, size_t, std::string>> GetDirectories() const;
+    void SetDirectory(const std::string& path, time_t mtime, size_t entry_count);
+    void RemoveDirectory(int id);
+    // Forgets every directory's mtime, so the next scan re-lists them all.
+    void ResetDirectories();
+
+    // Changes the leading old_prefix of every file and directory path to new_prefix, for when the
+    // library has moved within the backing FS. Returns how many files were changed.
+    size_t RelocateFiles(const std::string& old_prefix, const std::string& new_prefix);
+
+    bool GetSetting(const std::string& name, std::string& value) const;
+    void SetSetting(const std::string& name, const std::string& value);
+
     void ClearPaths();
-    bool GetRealPath(const std::string& path, std::string& pathOut) const;
-    int GetPathId(const std::string& path) const;
+    bool HasPaths() const;
+    // Calls the function with the ID, parent ID (zero for the root), name, file ID (zero for
+    // directories) and attributes (as returned by GetRealPath) of every path.
+    void ForEachPath(
+        const std::function<void(int, int, const std::string&, int, const struct stat&)>& fn
+        ) const;
+    // The ID of the latest change recorded to the paths, or zero if there are none.
+    int GetLastPathChange() const;
+    // Calls the function with the change's ID, the path's ID, parent ID (zero for the root) and
+    // name, and whether the name was added or removed (or else only the file's attributes
+    // changed), for every change to the paths after the given one, in order. Returns false,
+    // without calling it, if some of those changes were already forgotten, having been made over
+    // a minute ago.
+    bool ForEachPathChange(
+        int after,
+        const std::function<void(int, int, int, const std::string&, bool)>& fn
+        ) const;
+    // Counts changes made by other connections (including other processes) since this one was
+    // opened. Nothing writes through the filesystem's own connection once it's mounted, so this
+    // changing is how it learns that the paths may have.
+    int GetDataVersion() const;
+    // The real path is empty for directories. If statOut is given, it gets the file's size, mtime
+    // and mode as of the last scan; the mode is zero for directories, or if they aren't known.
+    bool GetRealPath(int path_id, std::string& pathOut, struct stat *statOut = nullptr) const;
+    // Like GetRealPath, but also gets the file's ID, which is zero for directories.
+    bool GetFileForPath(int path_id, int *file_id, std::string& pathOut, struct stat *statOut = nullptr) const;
+    // Gets the ID of a path's parent directory, which is zero for the root.
+    bool GetParentOfPath(int path_id, int *parent_id) const;
+    // Finds a path by its parent (zero for the root) and name. Returns its ID, or zero.
+    int LookupPath(int parent_id, const std::string& name, std::string& pathOut, struct stat *statOut = nullptr) const;
     int AddPath(const std::string& path, int parent_id, int track_id, int file_id);
-    std::vector<std::string> GetChildrenOfPath(
+    // Removes the file's paths other than the given one, e.g. after its tags changed its name.
+    void RemoveOtherPaths(int file_id, int path_id);
+    // Returns (path ID, path, real path, attributes) for each child, with the real path and
+    // attributes as returned by GetRealPath.
+    std::vector<std::tuple<int, std::string, std::string, struct stat>> GetChildrenOfPath(
         int parent_id,
         const std::function<bool(const std::string&, const std::string&)>& file_preference
         ) const;
     
+    // Starts a transaction holding the write lock, waiting for another connection to release it
+    // if need be. Taking it up front means the transaction can't fail later because another
+    // connection wrote in the meantime.
     void BeginTransaction();
+    // Like BeginTransaction, but waits at most the given time. Returns false if another
+    // connection still has the lock.
+    bool TryBeginTransaction(int timeoutMs = 0);
     void EndTransaction();
+    void RollbackTransaction();
 
     void CleanTables();
     void CleanPaths();
     void CleanTracks();
 
+    // Has the function called with the time each query takes, in nanoseconds, on the thread that
+    // ran it.
+    typedef void (*Profiler)(unsigned long long ns);
+    void SetProfiler(Profiler profiler);
+
 private:
 
+    int GetVersion() const;
+    // Finds or adds the track, and its artists and album.
+    int GetTrack(const MusicTags& tags);
     bool GetId(const char *table, std::string value, int *outId);
     void AddRow(const char *table, std::string value, int *outId);
     void CleanTable(const char *table);
 
     sqlite3 *m_dbHandle;
+    Profiler m_profiler;
 };
@@ -0,0 +1,82 @@
+//
+// MusicFS :: Physical Disk Layout Queries
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#include "disk_layout.h"
+
+using namespace std;
+
+#ifdef __linux__
+static bool get_first_extent(int fd, uint64_t *offset)
+{
+    // Room for the header plus exactly one extent.
+    alignas(struct fiemap) char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+    struct fiemap *map = reinterpret_cast<struct fiemap*>(buf);
+
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == -1)
+        return false;
+
+    if (map->fm_mapped_extents == 0)
+        return false;
+
+    const struct fiemap_extent& extent = map->fm_extents[0];
+    if (extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))
+        return false;
+
+    *offset = extent.fe_physical;
+    return true;
+}
+#endif
+
+DiskPosition get_disk_position(const string& path)
+{
+    DiskPosition pos;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        pos.device = static_cast<dev_t>(-1);
+        return pos;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) == -1)
+    {
+        close(fd);
+        pos.device = static_cast<dev_t>(-1);
+        return pos;
+    }
+
+    pos.device = s.st_dev;
+    pos.offset = s.st_ino;
+
+#ifdef __linux__
+    uint64_t offset;
+    if (get_first_extent(fd, &offset))
+    {
+        pos.physical = true;
+        pos.offset = offset;
+    }
+#endif
+
+    close(fd);
+    return pos;
+}
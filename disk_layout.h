@@ -0,0 +1,37 @@
+//
+// MusicFS :: Physical Disk Layout Queries
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct DiskPosition
+{
+    dev_t device = 0;
+
+    // Whether offset is the physical byte offset of the file's first extent. If not, it is the
+    // inode number, which on most filesystems roughly follows allocation order.
+    bool physical = false;
+
+    uint64_t offset = 0;
+
+    // Sorts by device, then files with known extents by offset, then the rest by inode.
+    bool operator<(const DiskPosition& other) const
+    {
+        if (device != other.device)
+            return device < other.device;
+        if (physical != other.physical)
+            return physical;
+        return offset < other.offset;
+    }
+};
+
+// Finds where a file's data starts, using FIEMAP where the filesystem supports it.
+// Files that can't be examined at all sort after everything else.
+DiskPosition get_disk_position(const std::string& path);
@@ -0,0 +1,206 @@
+//
+// MusicFS :: Pool of Open Backing Files
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MUSICFS_LOG_SUBSYS "FdPool"
+#include "logging.h"
+
+#include "fd_pool.h"
+
+using namespace std;
+
+static void close_all(const vector<int>& fds)
+{
+    for (int fd : fds)
+    {
+        if (close(fd) == -1)
+        {
+            PERROR("close");
+        }
+    }
+}
+
+FdPool::FdPool(size_t capacity)
+    : m_capacity(capacity)
+    , m_hits(0)
+    , m_misses(0)
+    , m_evictions(0)
+    , m_maxOpen(0)
+{
+}
+
+FdPool::~FdPool()
+{
+    for (const auto& entry : m_entries)
+    {
+        close(entry.first);
+    }
+}
+
+bool FdPool::Entry::Is(const string& p, const struct stat& known) const
+{
+    return path == p && mtime == known.st_mtime && size == known.st_size;
+}
+
+int FdPool::Acquire(int file_id, const string& path, const struct stat& known)
+{
+    vector<int> toClose;
+    {
+        lock_guard<mutex> lock(m_lock);
+        auto byFile = m_byFile.find(file_id);
+        if (byFile != m_byFile.end())
+        {
+            int fd = byFile->second;
+            Entry& entry = m_entries[fd];
+            if (entry.Is(path, known))
+            {
+                if (entry.refs++ == 0)
+                    m_idle.erase(entry.idle_pos);
+                m_hits++;
+                return fd;
+            }
+
+            // A different file with a reused ID, or an older version of this one. Stop handing
+            // the old one out; it's closed once nobody has it open.
+            m_byFile.erase(byFile);
+            if (entry.refs == 0)
+            {
+                m_idle.erase(entry.idle_pos);
+                m_entries.erase(fd);
+                toClose.push_back(fd);
+            }
+        }
+        m_misses++;
+    }
+    close_all(toClose);
+    toClose.clear();
+
+    // Don't hold the lock while opening; it may be slow.
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        auto byFile = m_byFile.find(file_id);
+        if (byFile != m_byFile.end() && m_entries[byFile->second].Is(path, known))
+        {
+            // Another thread opened it meanwhile. Use theirs, so there's only one to keep track of.
+            toClose.push_back(fd);
+            fd = byFile->second;
+            Entry& entry = m_entries[fd];
+            if (entry.refs++ == 0)
+                m_idle.erase(entry.idle_pos);
+        }
+        else
+        {
+            if (byFile != m_byFile.end())
+            {
+                // Another file, or another version of it; same as above.
+                int oldFd = byFile->second;
+                m_byFile.erase(byFile);
+                Entry& old = m_entries[oldFd];
+                if (old.refs == 0)
+                {
+                    m_idle.erase(old.idle_pos);
+                    m_entries.erase(oldFd);
+                    toClose.push_back(oldFd);
+                }
+            }
+
+            Entry& entry = m_entries[fd];
+            entry.file_id = file_id;
+            entry.path = path;
+            entry.mtime = known.st_mtime;
+            entry.size = known.st_size;
+            entry.refs = 1;
+            m_byFile[file_id] = fd;
+
+            Trim(toClose);
+            m_maxOpen = max(m_maxOpen, m_entries.size());
+        }
+    }
+    close_all(toClose);
+
+    return fd;
+}
+
+void FdPool::Release(int fd)
+{
+    vector<int> toClose;
+    {
+        lock_guard<mutex> lock(m_lock);
+        auto found = m_entries.find(fd);
+        if (found == m_entries.end())
+        {
+            ERROR("release of descriptor " << fd << ", which isn't in the pool");
+            return;
+        }
+
+        Entry& entry = found->second;
+        if (--entry.refs != 0)
+            return;
+
+        auto byFile = m_byFile.find(entry.file_id);
+        if (byFile == m_byFile.end() || byFile->second != fd)
+        {
+            // It was replaced while in use.
+            m_entries.erase(found);
+            toClose.push_back(fd);
+        }
+        else
+        {
+            m_idle.push_front(fd);
+            entry.idle_pos = m_idle.begin();
+            Trim(toClose);
+        }
+    }
+    close_all(toClose);
+}
+
+void FdPool::Trim(vector<int>& toClose)
+{
+    while (m_entries.size() > m_capacity && !m_idle.empty())
+    {
+        int fd = m_idle.back();
+        m_idle.pop_back();
+        m_byFile.erase(m_entries[fd].file_id);
+        m_entries.erase(fd);
+        toClose.push_back(fd);
+        m_evictions++;
+    }
+}
+
+string FdPool::GetState() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    unsigned long long total = m_hits + m_misses;
+
+    stringstream ss;
+    ss << "capacity: " << m_capacity << "\n"
+        << "open: " << m_entries.size() << "\n"
+        << "idle: " << m_idle.size() << "\n"
+        << "max_open: " << m_maxOpen << "\n"
+        << "hits: " << m_hits << "\n"
+        << "misses: " << m_misses << "\n"
+        << "hit_rate: " << (total == 0 ? 0.0 : static_cast<double>(m_hits) / total) << "\n"
+        << "evictions: " << m_evictions << "\n";
+    return ss.str();
+}
@@ -0,0 +1,74 @@
+//
+// MusicFS :: Pool of Open Backing Files
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+struct stat;
+
+// Keeps backing files open for reading between uses, so programs that open the same file
+// repeatedly (to read its tags, then again to play it) don't pay for opening it each time, which
+// on network filesystems means a round trip to the server. Concurrent opens of the same file share
+// one descriptor; files nobody has open are closed least recently used first once more than the
+// pool's capacity are open.
+class FdPool
+{
+public:
+    // A capacity of zero closes files as soon as nobody has them open.
+    FdPool(size_t capacity);
+    ~FdPool();
+
+    FdPool(const FdPool&) = delete;
+    FdPool& operator=(const FdPool&) = delete;
+
+    // Returns a read-only descriptor for the given file, or -1 with errno set. The path, relative
+    // or absolute, is what's opened if the file isn't already open. The descriptor is shared, so
+    // it must only be used with positioned reads, and must be given back with Release.
+    //
+    // known is the file's mtime and size as the database has them. A descriptor opened when the
+    // database had something else is for an older version of the file (replaced by a rename, say,
+    // or a file whose ID was reused), so it isn't handed out again.
+    int Acquire(int file_id, const std::string& path, const struct stat& known);
+    void Release(int fd);
+
+    std::string GetState() const;
+
+private:
+    struct Entry
+    {
+        int file_id;
+        std::string path;
+        time_t mtime;
+        off_t size;
+        unsigned int refs;
+        std::list<int>::iterator idle_pos; // valid when refs is zero
+
+        bool Is(const std::string& p, const struct stat& known) const;
+    };
+
+    // Takes the least recently used idle descriptors out of the pool until it's within capacity,
+    // and adds them to toClose. They should be closed after unlocking.
+    void Trim(std::vector<int>& toClose);
+
+    const size_t m_capacity;
+
+    mutable std::mutex m_lock;
+    std::unordered_map<int, Entry> m_entries;   // by descriptor
+    std::unordered_map<int, int> m_byFile;      // file ID to descriptor
+    std::list<int> m_idle;                      // descriptors nobody has open, most recent first
+
+    unsigned long long m_hits;
+    unsigned long long m_misses;
+    unsigned long long m_evictions;
+    size_t m_maxOpen;
+};
@@ -4,17 +4,21 @@
 // Copyright (c) 2014-2015 by William R. Fraser
 //
 
+#include <algorithm>
+#include <atomic>
 #include <deque>
 #include <functional>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
 
 #define MUSICFS_LOG_SUBSYS "Groveler"
 #include "logging.h"
@@ -23,46 +27,151 @@
 #include "database.h"
 #include "path_pattern.h"
 #include "aliases.h"
+#include "scan_scheduler.h"
+#include "disk_layout.h"
+#include "tag_cache.h"
+#include "scan_filter.h"
+#include "batch_stat.h"
+#include "relocate.h"
 #include "groveler.h"
 
 using namespace std;
 
-static bool equals_nocase(char a, char b)
+struct FileIdentity
 {
-    return ::tolower(a) == ::tolower(b);
-}
+    dev_t device;
+    ino_t inode;
+
+    bool operator==(const FileIdentity& other) const
+    {
+        return device == other.device && inode == other.inode;
+    }
+};
+
+struct FileIdentityHash
+{
+    size_t operator()(const FileIdentity& id) const
+    {
+        return hash<ino_t>()(id.inode) ^ (hash<dev_t>()(id.device) << 1);
+    }
+};
+
+struct DirectoryRecord
+{
+    int id;
+    time_t mtime;
+    size_t entry_count;
+    bool visited;
+};
+
+// TagLib reads the tag and header blocks, not the whole file. This is a rough upper bound of how
+// much it reads, for I/O budgeting.
+static const size_t s_tagReadEstimate = 256 * 1024;
+
+// How many paths are handed to the batch stat engine at a time.
+static const size_t s_statBatchSize = 1024;
 
-static bool file_extension_filter(const string& path)
+// With fail_if_busy, how long to wait for another connection's write lock anyway. Long enough for
+// the revalidator to update a file, but not for a scan.
+static const int s_busyWaitMs = 1000;
+
+static void throttle(const GrovelOptions& options, size_t ops, size_t bytes = 0)
 {
-    // TODO: limit grovel results to filetypes we care about
-    // this will potentially save MusicInfo from doing a bunch of work
+    if (options.scheduler != nullptr)
+        options.scheduler->Acquire(ops, bytes);
+}
 
-    static const vector<string> s_extensions {
-        "mp3", "flac", "wma", "m4a", "mp4", "ogg"
-    };
+static bool cancelled(const GrovelOptions& options)
+{
+    return options.cancel != nullptr && options.cancel->load();
+}
 
-    for (const string& ext : s_extensions)
+// Stats all the given paths, in batches, and adds the ones that succeed to 'stats'.
+static void stat_files(
+    BatchStat& statter,
+    const GrovelOptions& options,
+    const vector<string>& paths,
+    unordered_map<string, struct stat>& stats
+    )
+{
+    vector<StatResult> results;
+    for (size_t start = 0; start < paths.size(); start += s_statBatchSize)
     {
-        auto end = path.end();
-        auto begin = end - ext.length();
+        vector<string> batch(paths.begin() + start,
+                paths.begin() + min(start + s_statBatchSize, paths.size()));
 
-        if ((begin >= path.begin())
-                && (*(begin - 1) == '.')
-                && equal(begin, end, ext.begin(), equals_nocase))
+        throttle(options, batch.size());
+        statter.Stat(batch, results);
+
+        for (size_t i = 0; i < batch.size(); i++)
         {
-            return true;
+            if (results[i].error != 0)
+            {
+                ERROR("stat(" << batch[i] << "): " << strerror(results[i].error));
+                continue;
+            }
+            stats.emplace(move(batch[i]), results[i].st);
         }
     }
-
-    return false;
 }
 
-vector<pair<int,int>> grovel(const string& base_path, MusicDatabase& db)
+vector<pair<int,int>> grovel(const string& base_path, MusicDatabase& db, const GrovelOptions& options)
 {
+    static const ScanFilter s_defaultFilter;
+    const ScanFilter& filter = (options.filter != nullptr) ? *options.filter : s_defaultFilter;
+
+    // Unchanged directories aren't re-listed, so if the rules have changed since the last grovel,
+    // re-list everything: they may now exclude files that are in the database, or include ones
+    // in directories that were never recorded.
+    string fingerprint = filter.GetFingerprint();
+    string old_fingerprint;
+    if (!db.GetSetting("scan_filter", old_fingerprint) || old_fingerprint != fingerprint)
+    {
+        INFO("Scan rules have changed; re-listing every directory.");
+        db.ResetDirectories();
+        db.SetSetting("scan_filter", fingerprint);
+    }
+
+    // Directory records from the last grovel, keyed by path relative to base_path.
+    unordered_map<string, DirectoryRecord> known_dirs;
+    unordered_map<string, vector<string>> known_subdirs;
+    for (const auto& d : db.GetDirectories())
+    {
+        const string& path = get<3>(d);
+        if (!options.directory.empty()
+            && path != options.directory
+            && path.compare(0, options.directory.size() + 1, options.directory + "/") != 0)
+        {
+            continue;
+        }
+
+        known_dirs.emplace(path, DirectoryRecord{ get<0>(d), get<1>(d), get<2>(d), false });
+        if (!path.empty())
+        {
+            known_subdirs[path.substr(0, path.find_last_of('/'))].push_back(path);
+        }
+    }
+
+    // Directories modified in the same second as we list them might change again without their
+    // mtime changing, so those get recorded with a zero mtime, forcing a re-list next time.
+    time_t scan_start = time(nullptr);
+
     deque<string> directories;
-    directories.push_back(base_path);
+    directories.push_back(base_path + options.directory);
 
-    list<string> files;
+    vector<string> files;
+
+    // Files that are the same as one in 'files', and the path they were first found by.
+    vector<pair<string, string>> aliases;
+
+    unordered_map<FileIdentity, string, FileIdentityHash> file_identities;
+    unordered_set<FileIdentity, FileIdentityHash> visited_dirs;
+
+    // Directories that were not re-listed because their mtime is unchanged.
+    unordered_set<string> pruned_dirs;
+
+    BatchStat statter;
+    INFO("Using " << statter.GetMethodName() << " for stat() calls.");
 
     // First, take inventory of all the files in here.
 
@@ -71,11 +180,51 @@ vector<pair<int,int>> grovel(const string& base_path, MusicDatabase& db)
     size_t directory_count = 0;
     while (!directories.empty())
     {
+        if (cancelled(options))
+            return {};
+
         string path = directories.front();
         directories.pop_front();
+        string partial_path(path, base_path.size());
+
+        throttle(options, 1);
+        struct stat dirstat;
+        if (-1 == stat(path.c_str(), &dirstat))
+        {
+            PERROR("stat on directory \"" << path << "\"");
+            continue;
+        }
+
+        if (!visited_dirs.insert(FileIdentity{ dirstat.st_dev, dirstat.st_ino }).second)
+        {
+            // Reached through a symlink (or a bind mount) to somewhere we've already been.
+            DEBUG("directory already scanned by another path: " << path);
+            continue;
+        }
+
+        auto known = known_dirs.find(partial_path);
+        if (known != known_dirs.end() && known->second.mtime == dirstat.st_mtime)
+        {
+            // Nothing was added, removed, or renamed in here. Its subdirectories still need to be
+            // checked, but we know what they are without listing it.
+            DEBUG("directory unchanged: " << path);
+            known->second.visited = true;
+            pruned_dirs.insert(partial_path);
+
+            for (const string& subdir : known_subdirs[partial_path])
+            {
+                if (filter.IsExcluded(subdir, subdir.c_str() + subdir.find_last_of('/') + 1))
+                    continue;
+
+                directories.push_back(base_path + subdir);
+                directory_count++;
+            }
+            continue;
+        }
 
         DEBUG("directory: " << path);
             
+        throttle(options, 1);
         DIR* dir = opendir(path.c_str());
         if (dir == nullptr)
         {
@@ -83,8 +232,14 @@ vector<pair<int,int>> grovel(const string& base_path, MusicDatabase& db)
             continue;
         }
 
+        // Read the whole listing first, so the entries lacking a type can be stat'ed together.
+        vector<pair<string, unsigned char>> entries;
+        vector<FileIdentity> identities;
+        vector<string> unknown_paths;
+        vector<size_t> unknown_entries;
+
         dirent *e;
-        while ((e = readdir(dir)) != nullptr)
+        for (errno = 0; (e = readdir(dir)) != nullptr; errno = 0)
         {
             if ((strcmp(e->d_name, ".") == 0)
                 || (strcmp(e->d_name, "..") == 0))
@@ -92,72 +247,201 @@ vector<pair<int,int>> grovel(const string& base_path, MusicDatabase& db)
                 continue;
             }
 
-            string full_path = path;
-            full_path.push_back('/');
-            full_path.append(e->d_name);
+            entries.emplace_back(e->d_name, e->d_type);
+
+            // Identity of the file, for spotting the same file reached by different paths.
+            // For plain entries the directory entry has everything we need.
+            identities.push_back(FileIdentity{ dirstat.st_dev, e->d_ino });
+        }
+        if (errno != 0)
+        {
+            PERROR("readdir in \"" << path << "\"");
+        }
+
+        closedir(dir);
+
+        size_t entry_count = entries.size();
+
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const string& name = entries[i].first;
+            unsigned char type = entries[i].second;
 
-            if (e->d_type == DT_UNKNOWN)
+            // Check this before anything else, so excluded subtrees are never even opened.
+            if (filter.IsExcluded(partial_path + "/" + name, name.c_str()))
             {
-                // Do a stat() to fill in the d_type field.
-                struct stat statbuf;
-                if (-1 == stat(full_path.c_str(), &statbuf))
+                DEBUG("excluded: " << path << "/" << name);
+                entries[i].second = DT_UNKNOWN;
+                continue;
+            }
+
+            if (type == DT_UNKNOWN || type == DT_LNK)
+            {
+                unknown_paths.push_back(path + "/" + name);
+                unknown_entries.push_back(i);
+            }
+        }
+
+        if (!unknown_paths.empty())
+        {
+            // Do a stat() to fill in the type, following symlinks.
+            vector<StatResult> results;
+            throttle(options, unknown_paths.size());
+            statter.Stat(unknown_paths, results);
+
+            for (size_t i = 0; i < unknown_paths.size(); i++)
+            {
+                size_t entry = unknown_entries[i];
+                const struct stat& statbuf = results[i].st;
+
+                if (results[i].error != 0)
                 {
-                    PERROR("stat on \"" << full_path << "\"");
+                    ERROR("stat on \"" << unknown_paths[i] << "\": " << strerror(results[i].error));
+                    entries[entry].second = DT_UNKNOWN;
                 }
+                else if (S_ISREG(statbuf.st_mode))
+                    entries[entry].second = DT_REG;
+                else if (S_ISDIR(statbuf.st_mode))
+                    entries[entry].second = DT_DIR;
                 else
-                {
-                    if (S_ISREG(statbuf.st_mode))
-                        e->d_type = DT_REG;
-                    else if (S_ISDIR(statbuf.st_mode))
-                        e->d_type = DT_DIR;
-                }
+                    entries[entry].second = DT_UNKNOWN;
+
+                identities[entry] = FileIdentity{ statbuf.st_dev, statbuf.st_ino };
             }
+        }
 
-            if (e->d_type == DT_DIR)
+        // Anything not a directory or regular file by now is skipped.
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const string& name = entries[i].first;
+
+            string full_path = path;
+            full_path.push_back('/');
+            full_path.append(name);
+
+            if (entries[i].second == DT_DIR)
             {
                 directories.push_back(move(full_path));
                 directory_count++;
             }
-            else if (e->d_type == DT_REG || e->d_type == DT_LNK)
+            else if (entries[i].second == DT_REG)
             {
-                if (file_extension_filter(full_path))
+                if (filter.HasWantedExtension(name.c_str()))
                 {
-                    files.push_back(move(full_path));
+                    auto seen = file_identities.emplace(identities[i], full_path);
+                    if (seen.second)
+                    {
+                        files.push_back(move(full_path));
+                    }
+                    else
+                    {
+                        DEBUG("same file as " << seen.first->second << ": " << full_path);
+                        aliases.emplace_back(move(full_path), seen.first->second);
+                    }
                 }
             }
         }
-        if (errno != 0)
+
+        db.SetDirectory(partial_path, (dirstat.st_mtime < scan_start) ? dirstat.st_mtime : 0, entry_count);
+        if (known != known_dirs.end())
         {
-            PERROR("readdir in \"" << path << "\"");
+            known->second.visited = true;
         }
+    }
 
-        closedir(dir);
+    for (const auto& known : known_dirs)
+    {
+        if (!known.second.visited)
+        {
+            DEBUG("Directory not found; removing from DB: " << known.first);
+            db.RemoveDirectory(known.second.id);
+        }
     }
 
     INFO("Found " << files.size() << " files "
-        "in " << directory_count << " directories.");
+        "(plus " << aliases.size() << " more paths to the same files) "
+        "in " << directory_count << " directories "
+        "(" << pruned_dirs.size() << " unchanged directories not listed).");
 
     // Next, go through the DB and remove any tracks for which there are no
     // files or their file is unchanged since last grovel.
 
     INFO("Checking database freshness...");
 
-    vector<tuple<int, int, time_t, string>> db_files = db.GetFiles();
+    vector<tuple<int, int, time_t, string, off_t>> db_files = db.GetFiles(options.directory);
 
     INFO("Got " << db_files.size() << " files from database.");
 
+    // Files found by enumeration which still need their metadata extracted.
+    unordered_set<string> stale(files.begin(), files.end());
+    for (const auto& alias : aliases)
+    {
+        stale.insert(alias.first);
+    }
+
+    // Stat everything that's going to need it up front, all together, rather than one at a time.
+    vector<string> to_stat(files);
+    for (const auto& alias : aliases)
+    {
+        to_stat.push_back(alias.first);
+    }
+    if (options.strict)
+    {
+        for (const auto& f : db_files)
+        {
+            const string& partial_path = get<3>(f);
+            if (pruned_dirs.count(partial_path.substr(0, partial_path.find_last_of('/'))) != 0)
+                to_stat.push_back(base_path + partial_path);
+        }
+    }
+
+    unordered_map<string, struct stat> file_stats;
+    stat_files(statter, options, to_stat, file_stats);
+    to_stat.clear();
+
+    // Track IDs of files that are unchanged, in case they turn up as aliases of new paths.
+    unordered_map<string, int> fresh_track_ids;
+
     size_t skipped_count = 0;
     size_t removed_count = 0;
     for (const auto& f : db_files)
     {
+        if (cancelled(options))
+            return {};
+
         int fileId = get<0>(f);
-        //int trackId = get<1>(f);
+        int trackId = get<1>(f);
         time_t mtime = get<2>(f);
-        const string& path = base_path + get<3>(f);
+        const string& partial_path = get<3>(f);
+        off_t size = get<4>(f);
+        const string& path = base_path + partial_path;
+
+        bool in_pruned_dir = (pruned_dirs.count(partial_path.substr(0, partial_path.find_last_of('/'))) != 0);
+
+        if (in_pruned_dir)
+        {
+            // The rules may have changed since its directory was listed.
+            const char *name = partial_path.c_str() + partial_path.find_last_of('/') + 1;
+            if (filter.IsExcluded(partial_path, name) || !filter.HasWantedExtension(name))
+            {
+                DEBUG("File now excluded; removing from DB: " << path);
+                db.RemoveFile(fileId);
+                removed_count++;
+                continue;
+            }
+        }
+
+        if (in_pruned_dir && !options.strict)
+        {
+            // Its directory is unchanged, so assume the file is too.
+            skipped_count++;
+            fresh_track_ids.emplace(path, trackId);
+            continue;
+        }
 
-        auto pos = find(files.begin(), files.end(), path);
+        auto pos = stale.find(path);
 
-        if (pos == files.end())
+        if (!in_pruned_dir && pos == stale.end())
         {
             DEBUG("File not found; removing from DB: " << path);
             db.RemoveFile(fileId);
@@ -165,26 +449,43 @@ vector<pair<int,int>> grovel(const string& base_path, MusicDatabase& db)
         }
         else
         {
-            struct stat s;
-            int result = stat(path.c_str(), &s);
-            if (result != 0)
+            auto s = file_stats.find(path);
+            if (s == file_stats.end())
             {
-                PERROR("stat(" << path << ")");
+                // Couldn't stat it; already logged.
+                if (in_pruned_dir)
+                {
+                    db.RemoveFile(fileId);
+                    removed_count++;
+                }
                 continue;
             }
             
-            if (s.st_mtime == mtime)
+            if (s->second.st_mtime == mtime && (size < 0 || s->second.st_size == size))
             {
                 // MTime is identical; we can skip groveling this one.
                 DEBUG("File skipped due to MTime: " << path);
-                files.erase(pos);
+                if (size < 0)
+                {
+                    // Scanned by an older version that didn't record its attributes.
+                    db.UpdateFileStat(fileId, s->second);
+                }
+                if (pos != stale.end())
+                    stale.erase(pos);
                 skipped_count++;
+                fresh_track_ids.emplace(path, trackId);
             }
             else
             {
                 // TODO: don't do this, but do an update instead.
                 DEBUG("File has changed; removing from DB: " << path);
                 db.RemoveFile(fileId);
+                if (in_pruned_dir)
+                {
+                    // Wasn't enumerated, so it needs to be added explicitly.
+                    files.push_back(path);
+                    stale.insert(path);
+                }
             }
         }
     }
@@ -194,33 +495,83 @@ vector<pair<int,int>> grovel(const string& base_path, MusicDatabase& db)
 
     // Next, get metadata for remaining files and add to database.
     
+    // Keep them in enumeration order unless asked to do otherwise.
+    files.erase(remove_if(files.begin(), files.end(),
+                [&stale](const string& path) { return stale.count(path) == 0; }),
+            files.end());
+
+    if (options.physical_order)
+    {
+        INFO("Ordering " << files.size() << " files by disk position...");
+
+        vector<pair<DiskPosition, string>> positions;
+        positions.reserve(files.size());
+        for (string& path : files)
+        {
+            throttle(options, 1);
+            positions.emplace_back(get_disk_position(path), move(path));
+        }
+
+        stable_sort(positions.begin(), positions.end(),
+            [](const pair<DiskPosition, string>& a, const pair<DiskPosition, string>& b)
+            {
+                return a.first < b.first;
+            });
+
+        files.clear();
+        for (auto& pos : positions)
+        {
+            DEBUG("disk position: " << pos.first.device << ":" << pos.first.offset
+                << (pos.first.physical ? "" : " (inode)") << " " << pos.second);
+            files.push_back(move(pos.second));
+        }
+    }
+
     INFO("Extracting metadata from " << files.size() << " files...");
 
     vector<pair<int,int>> groveled_ids;
 
     size_t groveled_count = 0;
-    while (!files.empty())
+    size_t cached_count = 0;
+    for (const string& path : files)
     {
-        string path = files.front();
-        files.pop_front();
+        if (cancelled(options))
+            break;
 
-        MusicInfo info(path.c_str());
+        auto stat_pos = file_stats.find(path);
+        if (stat_pos == file_stats.end())
+            continue;
+        const struct stat& s = stat_pos->second;
 
-        if (info.has_tag())
+        bool has_tag;
+        MusicTags tags;
+        if (options.tag_cache != nullptr && options.tag_cache->Lookup(s, &has_tag, tags))
         {
-            string partial_path(path.c_str() + base_path.size(), path.size() - base_path.size());
+            DEBUG("tags found in cache: " << path);
+            cached_count++;
+        }
+        else
+        {
+            throttle(options, 1, min(static_cast<size_t>(s.st_size), s_tagReadEstimate));
+            MusicInfo info(path.c_str());
 
-            struct stat s;
-            if (0 != stat(path.c_str(), &s))
-            {
-                PERROR("stat(" << path << ")");
-                continue;
-            }
+            has_tag = info.has_tag();
+            if (has_tag)
+                tags = info.tags();
+
+            if (options.tag_cache != nullptr)
+                options.tag_cache->Store(s, has_tag, tags);
+        }
+
+        if (has_tag)
+        {
+            string partial_path(path.c_str() + base_path.size(), path.size() - base_path.size());
 
             int track_id, file_id;
-            db.AddTrack(info, partial_path, s.st_mtime, &track_id, &file_id);
+            db.AddTrack(tags, partial_path, s, &track_id, &file_id);
             groveled_count++;
             groveled_ids.emplace_back(track_id, file_id);
+            fresh_track_ids.emplace(path, track_id);
         }
         else
         {
@@ -228,7 +579,43 @@ vector<pair<int,int>> grovel(const string& base_path, MusicDatabase& db)
         }
     }
 
-    INFO("Groveled " << groveled_count << " new/updated files.");
+    // Other paths to the same files get their own file rows, sharing the original's track, so
+    // they're known next time without having to read their tags again.
+    size_t alias_count = 0;
+    for (const auto& alias : aliases)
+    {
+        const string& path = alias.first;
+        if (stale.count(path) == 0)
+            continue;
+
+        auto track = fresh_track_ids.find(alias.second);
+        if (track == fresh_track_ids.end())
+        {
+            DEBUG("no tag: " << path);
+            continue;
+        }
+
+        auto s = file_stats.find(path);
+        if (s == file_stats.end())
+            continue;
+
+        string partial_path(path.c_str() + base_path.size(), path.size() - base_path.size());
+        int file_id = db.AddFile(track->second, partial_path, s->second);
+        groveled_ids.emplace_back(track->second, file_id);
+        alias_count++;
+    }
+
+    if (options.tag_cache != nullptr)
+    {
+        options.tag_cache->Flush();
+        INFO("Got tags for " << cached_count << " files from the tag cache.");
+    }
+
+    if (cancelled(options))
+        return {};
+
+    INFO("Groveled " << groveled_count << " new/updated files, "
+        "and " << alias_count << " new paths to known files.");
 
     INFO("Removing un-referenced tracks, artists, albums, and folders.");
     
@@ -243,7 +630,8 @@ void build_paths(
     MusicDatabase& db,
     const PathPattern& pathPattern,
     const vector<pair<int,int>>& track_file_ids,
-    const ArtistAliases& aliases
+    const ArtistAliases& aliases,
+    vector<int> *file_path_ids
     )
 {
     unordered_map<string, int> paths;
@@ -288,6 +676,44 @@ void build_paths(
                 parent_id = pos->second;
             }
         }
+
+        if (file_path_ids != nullptr)
+            file_path_ids->push_back(parent_id);
     }
 }
 
+bool scan_library(
+    const string& base_path,
+    MusicDatabase& db,
+    const GrovelOptions& options,
+    const PathPattern& pathPattern,
+    const ArtistAliases& aliases
+    )
+{
+    if (!options.fail_if_busy)
+    {
+        db.BeginTransaction();
+    }
+    else if (!db.TryBeginTransaction(s_busyWaitMs))
+    {
+        INFO("Database is being written to by another connection; not scanning.");
+        return false;
+    }
+
+    if (options.directory.empty())
+        relocate_library(base_path, db);
+
+    vector<pair<int,int>> groveled_ids = grovel(base_path, db, options);
+    if (cancelled(options))
+    {
+        INFO("Scan cancelled; rolling back.");
+        db.RollbackTransaction();
+        return false;
+    }
+
+    INFO("Computing paths...");
+    build_paths(db, pathPattern, groveled_ids, aliases);
+
+    db.EndTransaction();
+    return true;
+}
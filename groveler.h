@@ -7,15 +7,65 @@
 #pragma once
 
 class ArtistAliases;
+class ScanScheduler;
+class TagCache;
+class ScanFilter;
+
+struct GrovelOptions
+{
+    // Directories whose mtime is unchanged since the last grovel are not re-listed, and the files
+    // recorded in them are assumed to be fresh. In strict mode, those files still get their mtimes
+    // checked, which catches tags edited in place.
+    bool strict = false;
+
+    // Extract metadata in the order files are laid out on disk rather than the order they were
+    // found in, which avoids a lot of seeking on rotational disks.
+    bool physical_order = false;
+
+    // Which files and directories to scan. If not set, the defaults are used.
+    const ScanFilter *filter = nullptr;
+
+    // If set, tags are looked up here before reading them from files, and stored after.
+    TagCache *tag_cache = nullptr;
+
+    // If set, all backing FS I/O done by the scan is charged against its budget.
+    ScanScheduler *scheduler = nullptr;
+
+    // If set, only this directory (relative to the backing FS path, starting with '/') and its
+    // subdirectories are scanned, and the rest of the database is left alone.
+    std::string directory;
+
+    // If set, the scan stops early when this becomes true. What it did so far must be rolled back.
+    const std::atomic<bool> *cancel = nullptr;
+
+    // If set, scan_library doesn't wait for another connection (another scan, or musicfs-index)
+    // to finish writing to the database, beyond a brief write like revalidating a file; it
+    // returns false instead.
+    bool fail_if_busy = false;
+};
 
 std::vector<std::pair<int,int>> grovel(
     const std::string& path,
-    MusicDatabase& db
+    MusicDatabase& db,
+    const GrovelOptions& options
     );
 
+// If file_path_ids is given, it gets the ID of each file's path, in the same order.
 void build_paths(
     MusicDatabase& db,
     const PathPattern& pathPattern,
     const std::vector<std::pair<int,int>>& track_file_ids,
+    const ArtistAliases& aliases,
+    std::vector<int> *file_path_ids = nullptr
+    );
+
+// Runs the whole pipeline: relocation check, grovel, and build_paths, all in one transaction, so
+// other connections see either none or all of the changes. Returns false if it was cancelled, in
+// which case nothing was changed.
+bool scan_library(
+    const std::string& path,
+    MusicDatabase& db,
+    const GrovelOptions& options,
+    const PathPattern& pathPattern,
     const ArtistAliases& aliases
     );
@@ -0,0 +1,196 @@
+//
+// MusicFS :: In-Memory Cache of File Headers and Trailers
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <string.h>
+#include <unistd.h>
+
+#include "header_cache.h"
+
+using namespace std;
+
+// How much of the start and end of each file to keep. ID3v2 tags with cover art can be bigger
+// than this, but readers mostly probe within the first few reads. The end is extended back to
+// a multiple of the kernel's usual read size, so its reads tend to fall entirely within it.
+static const off_t s_headBytes = 128 * 1024;
+static const off_t s_tailBytes = 64 * 1024;
+static const off_t s_alignment = 128 * 1024;
+
+// Finds which part of a file a read falls in: [start, end). Returns false if neither.
+static bool find_region(off_t file_size, off_t offset, size_t size, off_t *start, off_t *end, bool *isHead)
+{
+    off_t headEnd = min(file_size, s_headBytes);
+    off_t tailStart = max(headEnd, (file_size - s_tailBytes) / s_alignment * s_alignment);
+    off_t readEnd = min(offset + static_cast<off_t>(size), file_size);
+
+    if (offset < headEnd && readEnd <= headEnd)
+    {
+        *start = 0;
+        *end = headEnd;
+        *isHead = true;
+        return true;
+    }
+    if (offset >= tailStart && offset < file_size)
+    {
+        *start = tailStart;
+        *end = file_size;
+        *isHead = false;
+        return true;
+    }
+    return false;
+}
+
+HeaderCache::HeaderCache(size_t capacity_bytes)
+    : m_capacity(capacity_bytes)
+    , m_bytes(0)
+    , m_hits(0)
+    , m_misses(0)
+    , m_hitBytes(0)
+    , m_evictions(0)
+    , m_invalidations(0)
+{
+}
+
+bool HeaderCache::Covers(off_t file_size, off_t offset, size_t size)
+{
+    off_t start, end;
+    bool isHead;
+    return find_region(file_size, offset, size, &start, &end, &isHead);
+}
+
+ssize_t HeaderCache::Read(int file_id, time_t mtime, off_t file_size, char *buf, size_t size, off_t offset,
+    const Reader& readFile)
+{
+    off_t start, end;
+    bool isHead;
+    if (!find_region(file_size, offset, size, &start, &end, &isHead))
+        return readFile(buf, size, offset);
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        auto found = m_entries.find(file_id);
+        if (found != m_entries.end()
+            && (found->second.mtime != mtime || found->second.file_size != file_size))
+        {
+            Remove(found);
+            m_invalidations++;
+        }
+        else if (found != m_entries.end() && (isHead ? found->second.haveHead : found->second.haveTail))
+        {
+            const vector<char>& data = isHead ? found->second.head : found->second.tail;
+            size_t skip = offset - start;
+            size_t n = (skip < data.size()) ? min(size, data.size() - skip) : 0;
+            memcpy(buf, data.data() + skip, n);
+
+            m_lru.splice(m_lru.begin(), m_lru, found->second.lru_pos);
+            m_hits++;
+            m_hitBytes += n;
+            return n;
+        }
+        m_misses++;
+    }
+
+    vector<char> data(end - start);
+    size_t filled = 0;
+    while (filled < data.size())
+    {
+        ssize_t n = readFile(data.data() + filled, data.size() - filled, start + filled);
+        if (n == -1)
+            return -1;
+        if (n == 0)
+        {
+            // The file is shorter than the database says; it'll be caught by mtime next time.
+            data.resize(filled);
+            break;
+        }
+        filled += n;
+    }
+
+    size_t skip = offset - start;
+    size_t n = (skip < data.size()) ? min(size, data.size() - skip) : 0;
+    memcpy(buf, data.data() + skip, n);
+
+    if (data.size() > m_capacity)
+        return n;
+
+    lock_guard<mutex> lock(m_lock);
+    auto found = m_entries.find(file_id);
+    if (found == m_entries.end())
+    {
+        Entry& entry = m_entries[file_id];
+        entry.mtime = mtime;
+        entry.file_size = file_size;
+        entry.haveHead = false;
+        entry.haveTail = false;
+        m_lru.push_front(file_id);
+        entry.lru_pos = m_lru.begin();
+        found = m_entries.find(file_id);
+    }
+    else if (found->second.mtime != mtime || found->second.file_size != file_size)
+    {
+        // Changed again while we were reading; don't mix the two versions.
+        return n;
+    }
+
+    Entry& entry = found->second;
+    m_lru.splice(m_lru.begin(), m_lru, entry.lru_pos);
+    if (!(isHead ? entry.haveHead : entry.haveTail))
+    {
+        m_bytes += data.size();
+        if (isHead)
+        {
+            entry.head = move(data);
+            entry.haveHead = true;
+        }
+        else
+        {
+            entry.tail = move(data);
+            entry.haveTail = true;
+        }
+    }
+
+    while (m_bytes > m_capacity)
+    {
+        Remove(m_entries.find(m_lru.back()));
+        m_evictions++;
+    }
+
+    return n;
+}
+
+void HeaderCache::Remove(unordered_map<int, Entry>::iterator entry)
+{
+    m_bytes -= entry->second.head.size() + entry->second.tail.size();
+    m_lru.erase(entry->second.lru_pos);
+    m_entries.erase(entry);
+}
+
+string HeaderCache::GetState() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    unsigned long long total = m_hits + m_misses;
+
+    stringstream ss;
+    ss << "capacity: " << m_capacity << "\n"
+        << "bytes: " << m_bytes << "\n"
+        << "files: " << m_entries.size() << "\n"
+        << "hits: " << m_hits << "\n"
+        << "misses: " << m_misses << "\n"
+        << "hit_rate: " << (total == 0 ? 0.0 : static_cast<double>(m_hits) / total) << "\n"
+        << "hit_bytes: " << m_hitBytes << "\n"
+        << "evictions: " << m_evictions << "\n"
+        << "invalidations: " << m_invalidations << "\n";
+    return ss.str();
+}
@@ -0,0 +1,70 @@
+//
+// MusicFS :: In-Memory Cache of File Headers and Trailers
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Media servers and players re-read the start and end of every file whenever they refresh their
+// libraries, because that's where tags are kept (ID3v2 and FLAC metadata at the start; ID3v1,
+// APE and Lyrics3 at the end). This keeps those parts of files in memory, so a refresh doesn't
+// have to touch the backing FS at all. Each part is read in full the first time any read falls
+// within it, and kept until the file's mtime or size changes, or it's the least recently used
+// when the cache is full.
+class HeaderCache
+{
+public:
+    // Reads the file like pread.
+    typedef std::function<ssize_t(char *buf, size_t size, off_t offset)> Reader;
+
+    HeaderCache(size_t capacity_bytes);
+
+    HeaderCache(const HeaderCache&) = delete;
+    HeaderCache& operator=(const HeaderCache&) = delete;
+
+    // Whether a read lies entirely within the start or end of a file of the given size, and so
+    // should go through the cache.
+    static bool Covers(off_t file_size, off_t offset, size_t size);
+
+    // Like pread, for a read that Covers says the cache handles.
+    ssize_t Read(int file_id, time_t mtime, off_t file_size, char *buf, size_t size, off_t offset,
+        const Reader& readFile);
+
+    std::string GetState() const;
+
+private:
+    struct Entry
+    {
+        time_t mtime;
+        off_t file_size;
+        std::vector<char> head;
+        std::vector<char> tail;
+        bool haveHead;
+        bool haveTail;
+        std::list<int>::iterator lru_pos;
+    };
+
+    // Called with m_lock held.
+    void Remove(std::unordered_map<int, Entry>::iterator entry);
+
+    const size_t m_capacity;
+
+    mutable std::mutex m_lock;
+    std::unordered_map<int, Entry> m_entries;   // by file ID
+    std::list<int> m_lru;                       // file IDs, most recently used first
+    size_t m_bytes;
+
+    unsigned long long m_hits;
+    unsigned long long m_misses;
+    unsigned long long m_hitBytes;
+    unsigned long long m_evictions;
+    unsigned long long m_invalidations;
+};
@@ -0,0 +1,230 @@
+//
+// MusicFS :: Offline Indexer
+//
+// Builds or refreshes a MusicFS database without mounting anything, so it can be run on a
+// schedule (e.g. from cron) and the mount started with -o scan=none.
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define MUSICFS_LOG_SUBSYS "Indexer"
+#include "logging.h"
+
+#include "util.h"
+#include "musicinfo.h"
+#include "database.h"
+#include "path_pattern.h"
+#include "aliases.h"
+#include "tag_cache.h"
+#include "scan_filter.h"
+#include "groveler.h"
+
+using namespace std;
+
+int musicfs_log_level = LOG_LEVEL_WARNING;
+bool musicfs_log_stderr = true;
+
+void usage()
+{
+    cerr <<
+    // Limit to 80 columns:
+    //   ###############################################################################
+        "usage: musicfs-index [options] <backing> <database>\n"
+        "\n"
+        "Scans <backing> for music and brings <database> up to date, without mounting\n"
+        "it. Mount the result with `musicfs -o scan=none,database=<database>`.\n"
+        "\n"
+        "options:\n"
+        "   -p, --pattern=<pattern> Path generation pattern; see musicfs --help.\n"
+        "   -t, --tag_cache=<path>  Path to a cache of file tags.\n"
+        "   -e, --scan_extensions=<list>\n"
+        "                           Semicolon-delimited list of file extensions to\n"
+        "                               scan for tags.\n"
+        "   -x, --exclude=<list>    Semicolon-delimited list of glob patterns of files\n"
+        "                               and directories to skip.\n"
+        "   -i, --include=<list>    Like exclude, but for files and directories to\n"
+        "                               scan even if an earlier pattern excluded them.\n"
+        "   -a, --aliases=<path>    Path to a file listing artist aliases.\n"
+        "   -s, --strict_scan       Check the modification time of every known file.\n"
+        "   -o, --physical_order    Read new files' tags in disk order.\n"
+        "   -n, --nice=<n>          Run at the given CPU scheduling priority.\n"
+        "   -I, --idle_io           Only do I/O when no other process wants to (Linux\n"
+        "                               only; like `ionice -c 3`).\n"
+        "   -v, --verbose           Enable informational messages.\n"
+        "   -d, --debug             Enable all debugging messages.\n"
+        "\n"
+        "The pattern, extension and alias options must match the ones the mount uses.\n"
+        "\n";
+}
+
+static bool set_idle_io_priority()
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    // From linux/ioprio.h, which isn't exported to userspace everywhere.
+    const int IOPRIO_CLASS_IDLE = 3;
+    const int IOPRIO_CLASS_SHIFT = 13;
+    const int IOPRIO_WHO_PROCESS = 1;
+
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    const char *pattern = default_pattern;
+    const char *tag_cache_path = nullptr;
+    const char *aliases_conf = nullptr;
+    ScanFilter scan_filter;
+    GrovelOptions grovelOptions;
+    bool idle_io = false;
+    bool set_nice = false;
+    int nice_value = 0;
+
+    static const option long_options[] = {
+        { "pattern",            required_argument,  nullptr, 'p' },
+        { "tag_cache",          required_argument,  nullptr, 't' },
+        { "scan_extensions",    required_argument,  nullptr, 'e' },
+        { "exclude",            required_argument,  nullptr, 'x' },
+        { "include",            required_argument,  nullptr, 'i' },
+        { "aliases",            required_argument,  nullptr, 'a' },
+        { "strict_scan",        no_argument,        nullptr, 's' },
+        { "physical_order",     no_argument,        nullptr, 'o' },
+        { "nice",               required_argument,  nullptr, 'n' },
+        { "idle_io",            no_argument,        nullptr, 'I' },
+        { "verbose",            no_argument,        nullptr, 'v' },
+        { "debug",              no_argument,        nullptr, 'd' },
+        { "help",               no_argument,        nullptr, 'h' },
+        { nullptr,              0,                  nullptr, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "p:t:e:x:i:a:son:Ivdh", long_options, nullptr)) != -1)
+    {
+        switch (c)
+        {
+        case 'p':
+            pattern = optarg;
+            break;
+        case 't':
+            tag_cache_path = optarg;
+            break;
+        case 'e':
+            scan_filter.SetExtensions(split(optarg, ';'));
+            break;
+        case 'x':
+            for (const string& glob : split(optarg, ';'))
+            {
+                scan_filter.AddRule(glob, true);
+            }
+            break;
+        case 'i':
+            for (const string& glob : split(optarg, ';'))
+            {
+                scan_filter.AddRule(glob, false);
+            }
+            break;
+        case 'a':
+            aliases_conf = optarg;
+            break;
+        case 's':
+            grovelOptions.strict = true;
+            break;
+        case 'o':
+            grovelOptions.physical_order = true;
+            break;
+        case 'n':
+            set_nice = true;
+            nice_value = atoi(optarg);
+            break;
+        case 'I':
+            idle_io = true;
+            break;
+        case 'v':
+            musicfs_log_level = LOG_LEVEL_INFO;
+            break;
+        case 'd':
+            musicfs_log_level = LOG_LEVEL_DEBUG;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        usage();
+        return 1;
+    }
+
+    string backing_fs = argv[optind];
+    string database_path = argv[optind + 1];
+
+    if (set_nice && setpriority(PRIO_PROCESS, 0, nice_value) == -1)
+    {
+        PERROR("setpriority");
+        return 1;
+    }
+
+    if (idle_io && !set_idle_io_priority())
+    {
+        PERROR("ioprio_set");
+        return 1;
+    }
+
+    PathPattern pathPattern(pattern);
+
+    ArtistAliases aliases;
+    if (aliases_conf != nullptr && !aliases.ParseFile(aliases_conf))
+    {
+        cerr << "musicfs-index: specified artist aliases file \""
+            << aliases_conf
+            << "\" could not be opened: "
+            << strerror(errno) << endl;
+        return 1;
+    }
+
+    try
+    {
+        MusicDatabase db(database_path);
+
+        unique_ptr<TagCache> tagCache;
+        if (tag_cache_path != nullptr)
+        {
+            tagCache.reset(new TagCache(tag_cache_path));
+        }
+
+        grovelOptions.tag_cache = tagCache.get();
+        grovelOptions.filter = &scan_filter;
+
+        scan_library(backing_fs, db, grovelOptions, pathPattern, aliases);
+    }
+    catch (exception *)
+    {
+        cerr << "musicfs-index: indexing failed.\n";
+        return 1;
+    }
+
+    return 0;
+}
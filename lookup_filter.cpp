@@ -0,0 +1,257 @@
+//
+// MusicFS :: Bloom Filter for Rejecting Lookups of Names That Don't Exist
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#define MUSICFS_LOG_SUBSYS "LookupFilter"
+#include "logging.h"
+
+#include "database.h"
+#include "lookup_filter.h"
+
+using namespace std;
+
+// About 1% false positives, for 10 bits per name.
+static const size_t s_bitsPerName = 10;
+static const unsigned s_hashes = 7;
+
+// How often to check for changes made by other processes.
+static const chrono::seconds s_checkInterval(1);
+
+// Names are added to the filter as they're added to the database, until they come to more than
+// 1/s_growthDivisor of those it was built for; then it's rebuilt at the right size. By then
+// there are 8 bits per name, for about 2.5% false positives.
+static const size_t s_growthDivisor = 4;
+
+// FNV-1a over the parent ID and name, plus a second hash derived from it, for double hashing.
+static void hash_name(int parent_id, const string& name, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < sizeof(parent_id); i++)
+    {
+        hash ^= static_cast<uint8_t>(static_cast<uint32_t>(parent_id) >> (i * 8));
+        hash *= 0x100000001b3ull;
+    }
+    for (char c : name)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ull;
+    }
+    *h1 = hash;
+
+    // splitmix64's finalizer.
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    *h2 = hash | 1;
+}
+
+LookupFilter::LookupFilter(const MusicDatabase& db)
+    : m_db(db)
+    , m_paths(0)
+    , m_valid(false)
+    , m_building(false)
+    , m_invalidated(false)
+    , m_dataVersion(0)
+    , m_lastChange(0)
+    , m_added(0)
+    , m_rejected(0)
+    , m_passed(0)
+    , m_falsePositives(0)
+    , m_unfiltered(0)
+    , m_rebuilds(0)
+    , m_updates(0)
+{
+}
+
+bool LookupFilter::MightExist(int parent_id, const string& name)
+{
+    unique_lock<mutex> lock(m_lock);
+    if (!Refresh(lock))
+    {
+        m_unfiltered++;
+        return true;
+    }
+
+    uint64_t h1, h2;
+    hash_name(parent_id, name, &h1, &h2);
+    uint64_t bits = m_bits.size() * 64;
+    for (unsigned i = 0; i < s_hashes; i++)
+    {
+        uint64_t bit = (h1 + i * h2) % bits;
+        if ((m_bits[bit / 64] & (1ull << (bit % 64))) == 0)
+        {
+            m_rejected++;
+            return false;
+        }
+    }
+
+    m_passed++;
+    return true;
+}
+
+void LookupFilter::RecordLookup(bool found)
+{
+    lock_guard<mutex> lock(m_lock);
+    if (!found)
+        m_falsePositives++;
+}
+
+void LookupFilter::Invalidate()
+{
+    lock_guard<mutex> lock(m_lock);
+    m_invalidated = true;
+}
+
+void LookupFilter::Update()
+{
+    unique_lock<mutex> lock(m_lock);
+    m_built.wait(lock, [this]() { return !m_building; });
+    m_invalidated = true;
+    Refresh(lock);
+}
+
+bool LookupFilter::Refresh(unique_lock<mutex>& lock)
+{
+    if (m_building)
+        return false;
+
+    bool stale = !m_valid || m_invalidated;
+    auto now = chrono::steady_clock::now();
+    if (stale || now - m_lastCheck >= s_checkInterval)
+    {
+        m_lastCheck = now;
+        int dataVersion = m_db.GetDataVersion();
+        stale = stale || dataVersion != m_dataVersion;
+
+        // Note the version being built from, so changes made meanwhile cause another update.
+        m_dataVersion = dataVersion;
+    }
+    if (!stale)
+        return true;
+
+    // Likewise, being told of changes while building means building again. Added names can
+    // just be added to the filter, as long as it doesn't get too full; removed ones have to stay
+    // until it's rebuilt, but false positives are fine.
+    m_invalidated = false;
+    m_building = true;
+    bool rebuild = !m_valid;
+    int lastChange = m_lastChange;
+    size_t capacity = m_paths / s_growthDivisor - m_added;
+    lock.unlock();
+
+    vector<pair<uint64_t, uint64_t>> hashes;
+    auto add = [&hashes](int parent_id, const string& name)
+    {
+        uint64_t h1, h2;
+        hash_name(parent_id, name, &h1, &h2);
+        hashes.emplace_back(h1, h2);
+    };
+    try
+    {
+        if (!rebuild)
+        {
+            bool complete = m_db.ForEachPathChange(lastChange,
+                [&](int id, int, int parent_id, const string& name, bool entry)
+                {
+                    lastChange = id;
+                    if (entry)
+                        add(parent_id, name);
+                });
+            rebuild = !complete || hashes.size() > capacity;
+        }
+
+        if (rebuild)
+        {
+            // Note the last change first, so changes made while reading are added afterwards.
+            hashes.clear();
+            lastChange = m_db.GetLastPathChange();
+            m_db.ForEachPath([&add](int, int parent_id, const string& name, int, const struct stat&)
+                {
+                    add(parent_id, name);
+                });
+        }
+    }
+    catch (exception *)
+    {
+        ERROR("Failed to read paths; not filtering lookups.");
+        lock.lock();
+        m_valid = false;
+        m_building = false;
+        m_built.notify_all();
+        return false;
+    }
+
+    vector<uint64_t> filter;
+    if (rebuild)
+    {
+        filter.resize((hashes.size() * s_bitsPerName + 63) / 64 + 1, 0);
+        DEBUG("Building lookup filter of " << filter.size() * 64 << " bits for " << hashes.size()
+            << " paths.");
+    }
+
+    lock.lock();
+    if (rebuild)
+    {
+        m_bits = move(filter);
+        m_paths = hashes.size();
+        m_added = 0;
+        m_rebuilds++;
+    }
+    else if (lastChange != m_lastChange)
+    {
+        m_added += hashes.size();
+        m_updates++;
+    }
+
+    uint64_t bits = m_bits.size() * 64;
+    for (const auto& hash : hashes)
+    {
+        for (unsigned i = 0; i < s_hashes; i++)
+        {
+            uint64_t bit = (hash.first + i * hash.second) % bits;
+            m_bits[bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+
+    m_lastChange = lastChange;
+    m_valid = true;
+    m_building = false;
+    m_built.notify_all();
+    return true;
+}
+
+string LookupFilter::GetState() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    unsigned long long total = m_rejected + m_passed + m_unfiltered;
+
+    stringstream ss;
+    ss << "paths: " << m_paths + m_added << "\n"
+        << "filter_bytes: " << m_bits.size() * sizeof(uint64_t) << "\n"
+        << "lookups: " << total << "\n"
+        << "rejected: " << m_rejected << "\n"
+        << "passed: " << m_passed << "\n"
+        << "false_positives: " << m_falsePositives << "\n"
+        << "unfiltered: " << m_unfiltered << "\n"
+        << "rebuilds: " << m_rebuilds << "\n"
+        << "updates: " << m_updates << "\n";
+    return ss.str();
+}
@@ -0,0 +1,72 @@
+//
+// MusicFS :: Bloom Filter for Rejecting Lookups of Names That Don't Exist
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class MusicDatabase;
+
+// Clients constantly look up names that are never in the mount: .DS_Store, ._* files,
+// desktop.ini, folder.jpg, Thumbs.db, and so on. This keeps a Bloom filter over the names of
+// all paths in the database, by parent directory, so most of those lookups can be rejected
+// without querying the database. Names added to the database are added to the filter from the
+// changes it records: right away when told to, as it is after this process's own scans and
+// revalidation; otherwise (e.g. a musicfs-index run) within a second. It's only rebuilt from all
+// the paths when it gets too full, or it missed some changes.
+class LookupFilter
+{
+public:
+    LookupFilter(const MusicDatabase& db);
+
+    LookupFilter(const LookupFilter&) = delete;
+    LookupFilter& operator=(const LookupFilter&) = delete;
+
+    // False if the directory definitely has no entry by this name. True if it might; call
+    // RecordLookup afterwards with what the database said.
+    bool MightExist(int parent_id, const std::string& name);
+    void RecordLookup(bool found);
+
+    // Updates the filter before the next lookup. Call after changing the paths.
+    void Invalidate();
+
+    // Updates the filter now, from what's in the database now, waiting for any update already
+    // under way first. For the cache invalidator, which mustn't tell the kernel about new names
+    // until the filter will let lookups of them through.
+    void Update();
+
+    std::string GetState() const;
+
+private:
+    // Called with m_lock held. Returns whether the filter can be used.
+    bool Refresh(std::unique_lock<std::mutex>& lock);
+
+    const MusicDatabase& m_db;
+
+    mutable std::mutex m_lock;
+    std::vector<uint64_t> m_bits;
+    size_t m_paths;
+    bool m_valid;
+    bool m_building;
+    std::condition_variable m_built;
+    bool m_invalidated;
+    int m_dataVersion;
+    int m_lastChange;       // the last path change whose names were added
+    size_t m_added;         // names added since it was built, on top of m_paths
+    std::chrono::steady_clock::time_point m_lastCheck;
+
+    unsigned long long m_rejected;
+    unsigned long long m_passed;
+    unsigned long long m_falsePositives;
+    unsigned long long m_unfiltered;    // while the filter was being built
+    unsigned long long m_rebuilds;
+    unsigned long long m_updates;
+};
@@ -4,16 +4,21 @@
 // Copyright (c) 2014-2015 by William R. Fraser
 //
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <fuse_opt.h>
 
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -30,7 +35,19 @@ bool musicfs_log_stderr = false;
 #include "database.h"
 #include "path_pattern.h"
 #include "aliases.h"
+#include "scan_scheduler.h"
+#include "tag_cache.h"
+#include "scan_filter.h"
 #include "groveler.h"
+#include "revalidator.h"
+#include "fd_pool.h"
+#include "read_ahead.h"
+#include "track_prefetcher.h"
+#include "block_cache.h"
+#include "header_cache.h"
+#include "lookup_filter.h"
+#include "cache_invalidator.h"
+#include "op_stats.h"
 
 using namespace std;
 
@@ -44,12 +61,128 @@ struct musicfs_opts
     char *pattern;
     MusicDatabase *db;
     char *database_path;
+    char *tag_cache_path;
     time_t startup_time;
     vector<string> extension_priority;
     string aliases_conf;
+    ScanFilter scan_filter;
+    int strict_scan;
+    int physical_order;
+    unsigned int scan_ops;
+    unsigned long scan_bytes;
+    unsigned int scan_latency;
+    ScanScheduler *scheduler;
+    char *scan_mode;
+    int revalidate;
+    Revalidator *revalidator;
+    int passthrough;
+    unsigned int fd_pool_size;
+    FdPool *fd_pool;
+    unsigned long readahead;
+    ReadAheadEngine *read_ahead;
+    unsigned int prefetch_next;
+    TrackPrefetcher *prefetcher;
+    char *block_cache_path;
+    unsigned long block_cache_size;
+    BlockCache *block_cache;
+    unsigned long header_cache_size;
+    HeaderCache *header_cache;
+    LookupFilter *lookup_filter;
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    int keep_cache;
+    CacheInvalidator *invalidator;
 };
 static musicfs_opts musicfs = {};
 
+// Scanning in the background, when it's enabled.
+static function<void()> s_backgroundScan;
+static thread s_scanThread;
+static atomic<bool> s_cancelScan(false);
+
+#ifdef FUSE_CAP_PASSTHROUGH
+// Passthrough IDs registered with the kernel for open files, by backing file descriptor. Pooled
+// descriptors are shared by all opens of a file, and so are their passthrough IDs.
+struct BackingId
+{
+    int id;
+    unsigned int refs;
+};
+static mutex s_backingIdsLock;
+static unordered_map<int, BackingId> s_backingIds;
+#endif
+
+// Rescans a backing directory, given relative to the backing FS. Returns 0 or a negative errno.
+static function<int(const string&)> s_rescan;
+
+// Virtual files for controlling MusicFS while it's mounted. The directory isn't listed in the
+// root, so programs scanning the mount for music don't wander into it.
+static const char CONTROL_DIR_NAME[] = ".musicfs";
+static const char RESCAN_FILE_NAME[] = "rescan";
+static const char STATS_FILE_NAME[] = "stats";
+
+// Inode numbers are path IDs plus one, so the root (path ID 0) is FUSE_ROOT_ID. The control files
+// get numbers from the top of the range, which path IDs never reach.
+static const fuse_ino_t CONTROL_DIR_INO = numeric_limits<fuse_ino_t>::max() - 1;
+static const fuse_ino_t RESCAN_INO = numeric_limits<fuse_ino_t>::max() - 2;
+static const fuse_ino_t STATS_INO = numeric_limits<fuse_ino_t>::max() - 3;
+
+// How much of the next track to fetch with -o prefetch_next.
+static const size_t s_prefetchBytes = 2 * 1024 * 1024;
+
+// How long the kernel may cache names, attributes, and that names don't exist, by default.
+// Caching for longer than this needs the kernel to be told when the tree changes.
+static const double s_defaultTimeout = 1.0;
+
+// For telling the kernel when the tree changes.
+static fuse_session *s_session;
+
+static fuse_ino_t ino_from_path_id(int path_id)
+{
+    return static_cast<fuse_ino_t>(path_id) + 1;
+}
+
+static int path_id_from_ino(fuse_ino_t ino)
+{
+    return static_cast<int>(ino - 1);
+}
+
+static bool is_control_ino(fuse_ino_t ino)
+{
+    return ino == CONTROL_DIR_INO || ino == RESCAN_INO || ino == STATS_INO;
+}
+
+// A directory listing, built when reading it starts and handed out in pieces. Offsets given to
+// the kernel are indexes into it, so paging through it works the same whether the kernel asks
+// for plain readdir or readdirplus, and isn't affected by the database changing in between.
+struct DirEntry
+{
+    string name;
+    fuse_ino_t ino;
+    string partialRealPath; // empty for directories
+    struct stat known;      // attributes as recorded in the database
+};
+
+struct DirHandle
+{
+    vector<DirEntry> entries;
+    bool filled;
+};
+
+// An open music file.
+struct FileHandle
+{
+    int fd;                                 // shared by all opens of the file; see FdPool
+    unique_ptr<ReadAheadStream> readAhead;  // only with -o readahead
+    int path_id;
+    int file_id;
+    time_t mtime;
+    off_t size;                             // -1 if not known
+    off_t prefetchAt;                       // reading past here starts prefetching the next track
+    atomic<bool> prefetched;
+};
+
 int stat_real_file(const char *path, struct stat *stbuf)
 {
     string real_path = musicfs.backing_fs;
@@ -82,75 +215,267 @@ void fake_directory_stat(struct stat *stbuf)
     stbuf->st_nlink = 1;
 }
 
-int musicfs_access(const char *path, int mode)
+// Fills in the attributes of a control file or directory.
+void control_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+    fake_directory_stat(stbuf);
+    if (ino == RESCAN_INO)
+    {
+        stbuf->st_mode = S_IFREG | 0200; // --w-------
+    }
+    else if (ino == STATS_INO)
+    {
+        // Its size isn't known until it's opened; it's read with direct I/O, like /proc files.
+        stbuf->st_mode = S_IFREG | 0444; // -r--r--r--
+    }
+    stbuf->st_ino = ino;
+}
+
+// Fills in the attributes of a file from what the database recorded when it was scanned, so
+// listing a directory doesn't have to touch the backing FS.
+void known_file_stat(const struct stat& known, struct stat *stbuf)
+{
+    stbuf->st_mode = known.st_mode & ~0222; // Remove write permissions.
+    stbuf->st_size = known.st_size;
+    stbuf->st_blocks = (known.st_size + 511) / 512;
+    stbuf->st_uid  = getuid();
+    stbuf->st_gid  = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = known.st_mtime;
+    stbuf->st_nlink = 1;
+}
+
+// Fills in the attributes of a path, given its ID, the backing file it refers to, if any, and
+// that file's attributes as recorded in the database.
+int path_stat(int path_id, const string& partialRealPath, const struct stat& known, struct stat *stbuf)
+{
+    if (partialRealPath.empty())
+    {
+        fake_directory_stat(stbuf);
+    }
+    else if (known.st_mode != 0)
+    {
+        known_file_stat(known, stbuf);
+    }
+    else
+    {
+        // Scanned by a version that didn't record attributes.
+        int result = stat_real_file(partialRealPath.c_str(), stbuf);
+        if (result != 0)
+            return result;
+    }
+
+    stbuf->st_ino = ino_from_path_id(path_id);
+    return 0;
+}
+
+void musicfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    DEBUG("lookup " << parent << " " << name);
+    OpTimer timer(FuseOp::Lookup);
+
+    fuse_entry_param e = {};
+    e.attr_timeout = musicfs.attr_timeout;
+    e.entry_timeout = musicfs.entry_timeout;
+
+    if (parent == FUSE_ROOT_ID && strcmp(name, CONTROL_DIR_NAME) == 0)
+    {
+        e.ino = CONTROL_DIR_INO;
+    }
+    else if (parent == CONTROL_DIR_INO && strcmp(name, RESCAN_FILE_NAME) == 0)
+    {
+        e.ino = RESCAN_INO;
+    }
+    else if (parent == CONTROL_DIR_INO && strcmp(name, STATS_FILE_NAME) == 0)
+    {
+        e.ino = STATS_INO;
+    }
+
+    if (e.ino != 0)
+    {
+        control_stat(e.ino, &e.attr);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    if (is_control_ino(parent))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    // Names that don't exist get a negative entry, so the kernel doesn't ask again for a while.
+    // Most of them never get as far as the database.
+    int parent_id = path_id_from_ino(parent);
+    if (!musicfs.lookup_filter->MightExist(parent_id, name))
+    {
+        e.entry_timeout = musicfs.negative_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    string partialRealPath;
+    struct stat known;
+    int path_id = musicfs.db->LookupPath(parent_id, name, partialRealPath, &known);
+    musicfs.lookup_filter->RecordLookup(path_id != 0);
+
+    if (path_id != 0 && !partialRealPath.empty() && musicfs.revalidator != nullptr)
+    {
+        musicfs.revalidator->Check(path_id);
+        path_id = musicfs.db->LookupPath(parent_id, name, partialRealPath, &known);
+    }
+
+    if (path_id == 0)
+    {
+        e.entry_timeout = musicfs.negative_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    int result = path_stat(path_id, partialRealPath, known, &e.attr);
+    if (result != 0)
+    {
+        fuse_reply_err(req, -result);
+        return;
+    }
+
+    e.ino = e.attr.st_ino;
+    fuse_reply_entry(req, &e);
+}
+
+void musicfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
 {
-    DEBUG("access (" << mode << ") " << path);
+    // Inode numbers come straight from the database, so there's nothing to clean up.
+    fuse_reply_none(req);
+}
+
+void musicfs_access(fuse_req_t req, fuse_ino_t ino, int mode)
+{
+    DEBUG("access (" << mode << ") " << ino);
+
+    if (ino == CONTROL_DIR_INO)
+    {
+        fuse_reply_err(req, (mode & W_OK) ? EACCES : 0);
+        return;
+    }
+
+    if (ino == RESCAN_INO)
+    {
+        fuse_reply_err(req, (mode & (R_OK | X_OK)) ? EACCES : 0);
+        return;
+    }
+
+    if (ino == STATS_INO)
+    {
+        fuse_reply_err(req, (mode & (W_OK | X_OK)) ? EACCES : 0);
+        return;
+    }
 
     string partialRealPath;
-    bool exists = musicfs.db->GetRealPath(path, partialRealPath);
+    bool exists = musicfs.db->GetRealPath(path_id_from_ino(ino), partialRealPath);
 
-    if (strcmp(path, "/") != 0 && !exists)
-        return -ENOENT;
+    if (ino != FUSE_ROOT_ID && !exists)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
     // Writing is never OK.
     if (mode & W_OK)
-        return -EACCES;
-
-    if (partialRealPath.empty())
     {
-        return 0;
+        fuse_reply_err(req, EACCES);
+        return;
     }
-    else
+
+    if (!partialRealPath.empty() && (mode & X_OK))
     {
-        if (mode & X_OK)
-            return -EACCES;
-        else
-            return 0;
+        fuse_reply_err(req, EACCES);
+        return;
     }
+
+    fuse_reply_err(req, 0);
 }
 
-int musicfs_getattr(const char *path, struct stat *stbuf)
+void musicfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    DEBUG("getattr " << path);
-    if (strcmp(path, "/") == 0)
+    DEBUG("getattr " << ino);
+    OpTimer timer(FuseOp::Getattr);
+
+    struct stat stbuf = {};
+    if (ino == FUSE_ROOT_ID)
     {
-        fake_directory_stat(stbuf);
-        return 0;
+        fake_directory_stat(&stbuf);
+        stbuf.st_ino = ino;
+    }
+    else if (is_control_ino(ino))
+    {
+        control_stat(ino, &stbuf);
     }
     else
     {
+        int path_id = path_id_from_ino(ino);
+
+        if (musicfs.revalidator != nullptr)
+            musicfs.revalidator->Check(path_id);
+
         string partialRealPath;
-        bool exists = musicfs.db->GetRealPath(path, partialRealPath);
+        struct stat known;
+        bool exists = musicfs.db->GetRealPath(path_id, partialRealPath, &known);
 
         if (!exists)
-            return -ENOENT;
-
-        if (partialRealPath.empty())
         {
-            fake_directory_stat(stbuf);
-            return 0;
+            fuse_reply_err(req, ENOENT);
+            return;
         }
-        else
+
+        int result = path_stat(path_id, partialRealPath, known, &stbuf);
+        if (result != 0)
         {
-            return stat_real_file(partialRealPath.c_str(), stbuf);
+            fuse_reply_err(req, -result);
+            return;
         }
     }
+
+    fuse_reply_attr(req, &stbuf, musicfs.attr_timeout);
 }
 
-int musicfs_opendir(const char *path, fuse_file_info *fi)
+void musicfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
 {
-    DEBUG("opendir" << path);
+    DEBUG("setattr (" << to_set << ") " << ino);
 
-    int path_id = 0;
-    if (strcmp(path, "/") != 0)
+    // Shells truncate files they redirect output to.
+    if (ino == RESCAN_INO && to_set == FUSE_SET_ATTR_SIZE)
     {
-        path_id = musicfs.db->GetPathId(path);
-        if (path_id == 0)
-            return -ENOENT;
+        struct stat stbuf = {};
+        control_stat(ino, &stbuf);
+        fuse_reply_attr(req, &stbuf, musicfs.attr_timeout);
+        return;
     }
 
-    fi->fh = path_id;
-    return 0;
+    fuse_reply_err(req, EACCES);
+}
+
+void musicfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DEBUG("opendir " << ino);
+
+    if (ino != FUSE_ROOT_ID && ino != CONTROL_DIR_INO)
+    {
+        string partialRealPath;
+        bool exists = musicfs.db->GetRealPath(path_id_from_ino(ino), partialRealPath);
+        if (!exists)
+        {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        if (!partialRealPath.empty())
+        {
+            fuse_reply_err(req, ENOTDIR);
+            return;
+        }
+    }
+
+    fi->fh = reinterpret_cast<uint64_t>(new DirHandle{ {}, false });
+    fuse_reply_open(req, fi);
 }
 
 int filetype_ranking(const string& path)
@@ -173,180 +498,658 @@ int file_preference(const string& a, const string& b)
     return filetype_ranking(a) < filetype_ranking(b);
 }
 
-int musicfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+// Lists a directory into its handle.
+static void fill_dir(fuse_ino_t ino, DirHandle *dir)
 {
-    DEBUG("readdir " << path);
+    struct stat none = {};
+    dir->entries.clear();
+    dir->entries.push_back({ ".", ino, string(), none });
+    dir->entries.push_back({ "..", FUSE_ROOT_ID, string(), none });
 
-    int path_id = fi->fh;
-    vector<string> entries = musicfs.db->GetChildrenOfPath(path_id, file_preference);
+    if (ino == CONTROL_DIR_INO)
+    {
+        dir->entries.push_back({ RESCAN_FILE_NAME, RESCAN_INO, string(), none });
+        dir->entries.push_back({ STATS_FILE_NAME, STATS_INO, string(), none });
+    }
+    else
+    {
+        for (auto& child : musicfs.db->GetChildrenOfPath(path_id_from_ino(ino), file_preference))
+        {
+            const string& path = get<1>(child);
+            dir->entries.push_back({
+                path.substr(path.rfind('/') + 1),
+                ino_from_path_id(get<0>(child)),
+                move(get<2>(child)),
+                get<3>(child)
+            });
+        }
+    }
 
-    filler(buf, ".", nullptr, 0);
-    filler(buf, "..", nullptr, 0);
+    dir->filled = true;
+}
 
-    for (const string& entry : entries)
+// Fills in the attributes of a directory entry, the same way lookup would.
+static int entry_stat(const DirEntry& entry, struct stat *stbuf)
+{
+    if (is_control_ino(entry.ino))
     {
-        size_t path_len = strlen(path);
-        if (path_len > 1) path_len++;
+        control_stat(entry.ino, stbuf);
+        return 0;
+    }
 
-        string basename = entry.substr(path_len);
-        filler(buf, basename.c_str(), nullptr, 0);
+    return path_stat(path_id_from_ino(entry.ino), entry.partialRealPath, entry.known, stbuf);
+}
+
+static mode_t entry_type(const DirEntry& entry)
+{
+    bool isFile = !entry.partialRealPath.empty() || entry.ino == RESCAN_INO || entry.ino == STATS_INO;
+    return isFile ? S_IFREG : S_IFDIR;
+}
+
+static void reply_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi, bool plus)
+{
+    DirHandle *dir = reinterpret_cast<DirHandle*>(fi->fh);
+
+    if (offset == 0 || !dir->filled)
+    {
+        fill_dir(ino, dir);
     }
 
-    return 0;
+    vector<char> buf(size);
+    size_t used = 0;
+    for (size_t i = offset; i < dir->entries.size(); i++)
+    {
+        const DirEntry& entry = dir->entries[i];
+        size_t entrySize;
+
+        if (plus)
+        {
+            fuse_entry_param e = {};
+            if (i >= 2 && entry_stat(entry, &e.attr) == 0)
+            {
+                // "." and ".." don't get looked up, so they're left without attributes.
+                e.ino = entry.ino;
+                e.attr_timeout = musicfs.attr_timeout;
+                e.entry_timeout = musicfs.entry_timeout;
+            }
+            else
+            {
+                e.attr.st_ino = entry.ino;
+                e.attr.st_mode = entry_type(entry);
+            }
+
+            entrySize = fuse_add_direntry_plus(req, buf.data() + used, size - used, entry.name.c_str(), &e, i + 1);
+        }
+        else
+        {
+            struct stat stbuf = {};
+            stbuf.st_ino = entry.ino;
+            stbuf.st_mode = entry_type(entry);
+
+            entrySize = fuse_add_direntry(req, buf.data() + used, size - used, entry.name.c_str(), &stbuf, i + 1);
+        }
+
+        if (entrySize > size - used)
+            break;
+
+        used += entrySize;
+    }
+
+    fuse_reply_buf(req, buf.data(), used);
 }
 
-int musicfs_releasedir(const char *path, struct fuse_file_info *fi)
+void musicfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    DEBUG("releasedir " << path);
-    return 0;
+    DEBUG("readdir " << size << "@" << offset << " " << ino);
+    OpTimer timer(FuseOp::Readdir);
+    reply_dir(req, ino, size, offset, fi, false);
 }
 
-int musicfs_open(const char *path, struct fuse_file_info *fi)
+// Like readdir, but with each entry's attributes, so the kernel doesn't have to look each one up
+// afterwards.
+void musicfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    DEBUG("open " << path);
+    DEBUG("readdirplus " << size << "@" << offset << " " << ino);
+    OpTimer timer(FuseOp::Readdir);
+    reply_dir(req, ino, size, offset, fi, true);
+}
 
-    //TODO: check fi->flags ?
+void musicfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DEBUG("releasedir " << ino);
+    delete reinterpret_cast<DirHandle*>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+void musicfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DEBUG("open " << ino);
+    OpTimer timer(FuseOp::Open);
 
+    if (ino == RESCAN_INO)
+    {
+        if ((fi->flags & O_ACCMODE) == O_RDONLY)
+        {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+
+        // Whatever gets written is collected here, and acted on when the file is closed.
+        fi->fh = reinterpret_cast<uint64_t>(new string());
+        fuse_reply_open(req, fi);
+        return;
+    }
+
+    if (ino == STATS_INO)
+    {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+
+        // The statistics as of opening, so reading them in pieces gives a consistent picture.
+        fi->fh = reinterpret_cast<uint64_t>(new string(op_stats_report()));
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+        return;
+    }
+
+    if (is_control_ino(ino))
+    {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    // Music files are read-only. With atomic O_TRUNC, passing the flags through would let a
+    // truncating open empty the backing file.
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    int path_id = path_id_from_ino(ino);
+
+    if (musicfs.revalidator != nullptr)
+        musicfs.revalidator->Check(path_id);
+
+    int file_id;
     string partialRealPath;
-    bool found = musicfs.db->GetRealPath(path, partialRealPath);
+    struct stat known;
+    bool found = musicfs.db->GetFileForPath(path_id, &file_id, partialRealPath, &known);
     if (!found || partialRealPath.empty())
     {
-        return -ENOENT;
+        fuse_reply_err(req, found ? EISDIR : ENOENT);
+        return;
     }
 
     string realPath = musicfs.backing_fs;
     realPath += partialRealPath;
-    int fd = open(realPath.c_str(), fi->flags);
+    int fd = musicfs.fd_pool->Acquire(file_id, realPath, known);
     if (fd == -1)
     {
         PERROR("open");
-        return -errno;
+        fuse_reply_err(req, errno);
+        return;
     }
 
-    fi->fh = fd;
+    // The size and mtime are only needed for prefetching and the caches. If the database doesn't
+    // have them, the file does.
+    if (known.st_mode == 0
+        && (musicfs.prefetcher != nullptr || musicfs.block_cache != nullptr || musicfs.header_cache != nullptr))
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+            known = st;
+    }
 
-    return 0;
+    FileHandle *file = new FileHandle();
+    file->fd = fd;
+    file->path_id = path_id;
+    file->file_id = file_id;
+    file->mtime = known.st_mtime;
+    file->size = (known.st_mode != 0) ? known.st_size : -1;
+    file->prefetchAt = numeric_limits<off_t>::max();
+    if (musicfs.read_ahead != nullptr)
+    {
+        file->readAhead.reset(new ReadAheadStream(*musicfs.read_ahead, fd));
+    }
+    if (musicfs.prefetcher != nullptr && file->size != -1)
+    {
+        file->prefetchAt = file->size / 100 * musicfs.prefetch_next;
+    }
+    fi->fh = reinterpret_cast<uint64_t>(file);
+    if (musicfs.keep_cache)
+    {
+        // Changes are invalidated explicitly.
+        fi->keep_cache = 1;
+    }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (musicfs.passthrough)
+    {
+        // Have the kernel read the backing file directly. This can fail for some files, e.g. if
+        // the backing FS is itself stacked on another; those are read through MusicFS as usual.
+        lock_guard<mutex> lock(s_backingIdsLock);
+        auto backing = s_backingIds.find(fd);
+        if (backing != s_backingIds.end())
+        {
+            fi->backing_id = backing->second.id;
+            backing->second.refs++;
+        }
+        else
+        {
+            int backingId = fuse_passthrough_open(req, fd);
+            if (backingId > 0)
+            {
+                fi->backing_id = backingId;
+                s_backingIds[fd] = BackingId{ backingId, 1 };
+            }
+            else
+            {
+                DEBUG("passthrough not possible for " << realPath);
+            }
+        }
+    }
+#endif
+
+    fuse_reply_open(req, fi);
 }
 
-int musicfs_read(const char *path, char *buf, size_t buf_size, off_t offset, struct fuse_file_info *fi)
+// Reads from an open file's backing file, through read-ahead if it's enabled.
+static ssize_t read_backing(FileHandle *file, char *buf, size_t size, off_t offset)
 {
-    DEBUG("read " << buf_size << "@" << offset << " " << path);
+    if (file->readAhead)
+        return file->readAhead->Read(buf, size, offset);
+    return pread(file->fd, buf, size, offset);
+}
 
-    ssize_t r = pread(fi->fh, buf, buf_size, offset);
-    if (r == -1)
+// Reads from an open file, through the block cache if it's enabled.
+static ssize_t read_file(FileHandle *file, char *buf, size_t size, off_t offset)
+{
+    if (musicfs.block_cache != nullptr && file->size != -1)
     {
-        PERROR("read");
-        return -errno;
+        return musicfs.block_cache->Read(file->file_id, file->mtime, file->size, buf, size, offset,
+            [file](char *buf, size_t size, off_t offset) { return read_backing(file, buf, size, offset); });
+    }
+    return read_backing(file, buf, size, offset);
+}
+
+void musicfs_read(fuse_req_t req, fuse_ino_t ino, size_t buf_size, off_t offset, struct fuse_file_info *fi)
+{
+    DEBUG("read " << buf_size << "@" << offset << " " << ino);
+
+    if (ino == RESCAN_INO)
+    {
+        fuse_reply_err(req, EBADF);
+        return;
     }
-    else if (r != (ssize_t)buf_size)
+
+    if (ino == STATS_INO)
     {
-        DEBUG("fewer bytes read than requestd");
+        const string *stats = reinterpret_cast<string*>(fi->fh);
+        size_t start = min(static_cast<size_t>(offset), stats->size());
+        fuse_reply_buf(req, stats->data() + start, min(buf_size, stats->size() - start));
+        return;
+    }
+
+    OpTimer timer(FuseOp::Read);
+    FileHandle *file = reinterpret_cast<FileHandle*>(fi->fh);
+
+    auto start = chrono::steady_clock::now();
+    int result;
+    bool useHeaderCache = (musicfs.header_cache != nullptr && file->size != -1
+        && HeaderCache::Covers(file->size, offset, buf_size));
+    bool useBlockCache = (musicfs.block_cache != nullptr && file->size != -1);
+    if (useHeaderCache || useBlockCache || file->readAhead)
+    {
+        // The data passes through our memory anyway, so there's nothing to splice.
+        vector<char> data(buf_size);
+        ssize_t n;
+        if (useHeaderCache)
+        {
+            n = musicfs.header_cache->Read(file->file_id, file->mtime, file->size, data.data(), buf_size, offset,
+                [file](char *buf, size_t size, off_t offset) { return read_file(file, buf, size, offset); });
+        }
+        else
+        {
+            n = read_file(file, data.data(), buf_size, offset);
+        }
+
+        if (n == -1)
+        {
+            int error = errno;
+            ERROR("read " << buf_size << "@" << offset << " " << ino << " failed: " << strerror(error));
+            result = fuse_reply_err(req, error);
+        }
+        else
+        {
+            result = fuse_reply_buf(req, data.data(), n);
+        }
+    }
+    else
+    {
+        // Reply with the backing file's descriptor rather than its data, so libfuse can splice
+        // the data straight from the backing file into the reply, without copying it through our
+        // memory. It falls back to reading into a buffer itself when splicing isn't possible.
+        fuse_bufvec buf = {};
+        buf.count = 1;
+        buf.buf[0].size = buf_size;
+        buf.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        buf.buf[0].fd = file->fd;
+        buf.buf[0].pos = offset;
+
+        result = fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+    }
+    if (musicfs.scheduler != nullptr)
+    {
+        musicfs.scheduler->RecordForegroundRead(chrono::steady_clock::now() - start);
+    }
+
+    if (static_cast<off_t>(offset + buf_size) >= file->prefetchAt && !file->prefetched.exchange(true))
+    {
+        musicfs.prefetcher->TrackNearlyDone(file->path_id);
+    }
+
+    if (result != 0)
+    {
+        ERROR("read: failed to reply: " << strerror(result < 0 ? -result : result));
     }
-    return r;
 }
 
-int musicfs_release(const char *path, struct fuse_file_info *fi)
+void musicfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t buf_size, off_t offset, struct fuse_file_info *fi)
 {
-    DEBUG("release " << path);
+    DEBUG("write " << buf_size << "@" << offset << " " << ino);
 
-    int result = close(fi->fh);
-    if (result == -1)
+    if (ino != RESCAN_INO)
     {
-        PERROR("close");
-        return -errno;
+        fuse_reply_err(req, EBADF);
+        return;
     }
-    return 0;
+
+    reinterpret_cast<string*>(fi->fh)->append(buf, buf_size);
+    fuse_reply_write(req, buf_size);
 }
 
-static const char REALPATH_XATTR_NAME[] = "user.musicfs.real_path";
+void musicfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DEBUG("flush " << ino);
+
+    if (ino != RESCAN_INO)
+    {
+        fuse_reply_err(req, 0);
+        return;
+    }
 
-int musicfs_listxattr(const char *path, char *list, size_t size)
+    // Each line written is a backing directory to rescan. This happens before close() returns, so
+    // the writer can tell when it's done, and whether it worked.
+    string *written = reinterpret_cast<string*>(fi->fh);
+    int result = 0;
+    for (const string& line : split(written->c_str(), '\n'))
+    {
+        if (line.empty())
+            continue;
+
+        int lineResult = s_rescan ? s_rescan(line) : -ENOSYS;
+        if (lineResult != 0)
+            result = lineResult;
+    }
+    written->clear();
+
+    fuse_reply_err(req, -result);
+}
+
+void musicfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    DEBUG("listxattr " << path);
+    DEBUG("release " << ino);
 
-    if (strcmp(path, "/") == 0)
-        return 0;
+    if (ino == RESCAN_INO || ino == STATS_INO)
+    {
+        delete reinterpret_cast<string*>(fi->fh);
+        fuse_reply_err(req, 0);
+        return;
+    }
 
-    string partialRealPath;
-    bool exists = musicfs.db->GetRealPath(path, partialRealPath);
+    FileHandle *file = reinterpret_cast<FileHandle*>(fi->fh);
 
-    if (!exists)
-        return -ENOENT;
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (musicfs.passthrough)
+    {
+        lock_guard<mutex> lock(s_backingIdsLock);
+        auto backing = s_backingIds.find(file->fd);
+        if (backing != s_backingIds.end() && --backing->second.refs == 0)
+        {
+            fuse_passthrough_close(req, backing->second.id);
+            s_backingIds.erase(backing);
+        }
+    }
+#endif
 
-    if (partialRealPath.empty())
-        return 0;
+    // Wait for any read-ahead before giving the descriptor back.
+    int fd = file->fd;
+    delete file;
 
-    size_t requiredSize = sizeof(REALPATH_XATTR_NAME);
+    musicfs.fd_pool->Release(fd);
+    fuse_reply_err(req, 0);
+}
 
+static const char REALPATH_XATTR_NAME[] = "user.musicfs.real_path";
+static const char SCHEDULER_XATTR_NAME[] = "user.musicfs.scan_scheduler";
+static const char FD_POOL_XATTR_NAME[] = "user.musicfs.fd_pool";
+static const char READ_AHEAD_XATTR_NAME[] = "user.musicfs.read_ahead";
+static const char PREFETCH_XATTR_NAME[] = "user.musicfs.prefetch";
+static const char BLOCK_CACHE_XATTR_NAME[] = "user.musicfs.block_cache";
+static const char HEADER_CACHE_XATTR_NAME[] = "user.musicfs.header_cache";
+static const char LOOKUP_FILTER_XATTR_NAME[] = "user.musicfs.lookup_filter";
+static const char INVALIDATOR_XATTR_NAME[] = "user.musicfs.cache_invalidation";
+
+// Replies to a getxattr or listxattr request with the given value, or its size if that's all
+// that was asked for.
+static void reply_xattr(fuse_req_t req, size_t size, const char *value, size_t valueSize)
+{
     if (size == 0)
-        return requiredSize;
+        fuse_reply_xattr(req, valueSize);
+    else if (size < valueSize)
+        fuse_reply_err(req, ERANGE);
+    else
+        fuse_reply_buf(req, value, valueSize);
+}
 
-    if (size < requiredSize)
-        return -ERANGE;
+void musicfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    DEBUG("listxattr " << ino);
 
-    memcpy(list, REALPATH_XATTR_NAME, requiredSize);
-    return requiredSize;
+    if (ino == FUSE_ROOT_ID)
+    {
+        // Each name is followed by a NUL.
+        string names(FD_POOL_XATTR_NAME, sizeof(FD_POOL_XATTR_NAME));
+        names.append(LOOKUP_FILTER_XATTR_NAME, sizeof(LOOKUP_FILTER_XATTR_NAME));
+        if (musicfs.scheduler != nullptr)
+            names.append(SCHEDULER_XATTR_NAME, sizeof(SCHEDULER_XATTR_NAME));
+        if (musicfs.read_ahead != nullptr)
+            names.append(READ_AHEAD_XATTR_NAME, sizeof(READ_AHEAD_XATTR_NAME));
+        if (musicfs.prefetcher != nullptr)
+            names.append(PREFETCH_XATTR_NAME, sizeof(PREFETCH_XATTR_NAME));
+        if (musicfs.block_cache != nullptr)
+            names.append(BLOCK_CACHE_XATTR_NAME, sizeof(BLOCK_CACHE_XATTR_NAME));
+        if (musicfs.header_cache != nullptr)
+            names.append(HEADER_CACHE_XATTR_NAME, sizeof(HEADER_CACHE_XATTR_NAME));
+        if (musicfs.invalidator != nullptr)
+            names.append(INVALIDATOR_XATTR_NAME, sizeof(INVALIDATOR_XATTR_NAME));
+        reply_xattr(req, size, names.c_str(), names.size());
+        return;
+    }
+
+    if (is_control_ino(ino))
+    {
+        reply_xattr(req, size, nullptr, 0);
+        return;
+    }
+
+    string partialRealPath;
+    bool exists = musicfs.db->GetRealPath(path_id_from_ino(ino), partialRealPath);
+
+    if (!exists)
+        fuse_reply_err(req, ENOENT);
+    else if (partialRealPath.empty())
+        reply_xattr(req, size, nullptr, 0);
+    else
+        reply_xattr(req, size, REALPATH_XATTR_NAME, sizeof(REALPATH_XATTR_NAME));
 }
 
 #ifdef __APPLE__
-int musicfs_getxattr(const char *path, const char *name, char *value, size_t size,
-        u_int32_t position)
+void musicfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size,
+        uint32_t position)
 #else
-int musicfs_getxattr(const char *path, const char *name, char *value, size_t size)
+void musicfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 #endif
 {
-    DEBUG("getxattr(" << name << ") " << path);
+    DEBUG("getxattr(" << name << ") " << ino);
+    OpTimer timer(FuseOp::Getxattr);
 
 #ifdef __APPLE__
     if (position != 0)
     {
         ERROR("getxattr: macos position argument nonzero; this is unsupported");
-        return -EINVAL;
+        fuse_reply_err(req, EINVAL);
+        return;
     }
 #endif
 
+    if (ino == FUSE_ROOT_ID)
+    {
+        string state;
+        if (strcmp(name, FD_POOL_XATTR_NAME) == 0)
+        {
+            state = musicfs.fd_pool->GetState();
+        }
+        else if (strcmp(name, LOOKUP_FILTER_XATTR_NAME) == 0)
+        {
+            state = musicfs.lookup_filter->GetState();
+        }
+        else if (musicfs.scheduler != nullptr && strcmp(name, SCHEDULER_XATTR_NAME) == 0)
+        {
+            state = musicfs.scheduler->GetState();
+        }
+        else if (musicfs.read_ahead != nullptr && strcmp(name, READ_AHEAD_XATTR_NAME) == 0)
+        {
+            state = musicfs.read_ahead->GetState();
+        }
+        else if (musicfs.prefetcher != nullptr && strcmp(name, PREFETCH_XATTR_NAME) == 0)
+        {
+            state = musicfs.prefetcher->GetState();
+        }
+        else if (musicfs.block_cache != nullptr && strcmp(name, BLOCK_CACHE_XATTR_NAME) == 0)
+        {
+            state = musicfs.block_cache->GetState();
+        }
+        else if (musicfs.header_cache != nullptr && strcmp(name, HEADER_CACHE_XATTR_NAME) == 0)
+        {
+            state = musicfs.header_cache->GetState();
+        }
+        else if (musicfs.invalidator != nullptr && strcmp(name, INVALIDATOR_XATTR_NAME) == 0)
+        {
+            state = musicfs.invalidator->GetState();
+        }
+        else
+        {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+
+        reply_xattr(req, size, state.c_str(), state.size());
+        return;
+    }
+
     string partialRealPath;
-    bool exists = musicfs.db->GetRealPath(path, partialRealPath);
+    bool exists = !is_control_ino(ino) && musicfs.db->GetRealPath(path_id_from_ino(ino), partialRealPath);
 
     if (!exists)
-        return -ENOENT;
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-    if (partialRealPath.empty())
-        return -EINVAL;
+    if (partialRealPath.empty() || strcmp(name, REALPATH_XATTR_NAME) != 0)
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
 
-    if (strcmp(name, REALPATH_XATTR_NAME) == 0)
+    string fullPath = musicfs.backing_fs + partialRealPath;
+    reply_xattr(req, size, fullPath.c_str(), fullPath.size());
+}
+
+void musicfs_init(void *userdata, fuse_conn_info *conn)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (musicfs.passthrough)
     {
-        string fullPath = musicfs.backing_fs + partialRealPath;
+        if (conn->capable & FUSE_CAP_PASSTHROUGH)
+        {
+            conn->want |= FUSE_CAP_PASSTHROUGH;
+        }
+        else
+        {
+            WARN("The kernel doesn't support FUSE passthrough; reading files through MusicFS.");
+            musicfs.passthrough = 0;
+        }
+    }
+#endif
 
-        if (size == 0)
-            return fullPath.size();
+    // Let read replies be spliced from the backing files into the FUSE device.
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
 
-        if (size < fullPath.size())
-            return -ERANGE;
+    // This has to wait until now, because the process forks to daemonize.
+    if (s_backgroundScan)
+    {
+        s_scanThread = thread(s_backgroundScan);
+    }
+    if (musicfs.invalidator != nullptr)
+    {
+        musicfs.invalidator->Start();
+    }
+}
 
-        memcpy(value, fullPath.c_str(), fullPath.size());
-        return fullPath.size();
+void musicfs_destroy(void *userdata)
+{
+    if (s_scanThread.joinable())
+    {
+        s_cancelScan = true;
+        s_scanThread.join();
     }
-    else
+    if (musicfs.invalidator != nullptr)
     {
-        return -EINVAL;
+        musicfs.invalidator->Stop();
     }
 }
 
-static fuse_operations MusicFS_Opers = {};
+static fuse_lowlevel_ops MusicFS_Opers = {};
 void musicfs_init_fuse_operations()
 {
 #define IMPL(_func) MusicFS_Opers._func = musicfs_##_func
+    IMPL(lookup);
+    IMPL(forget);
     IMPL(access);
     IMPL(getattr);
+    IMPL(setattr);
     IMPL(opendir);
     IMPL(readdir);
+    IMPL(readdirplus);
     IMPL(releasedir);
     IMPL(open);
     IMPL(read);
     IMPL(release);
+    IMPL(write);
+    IMPL(flush);
     IMPL(listxattr);
     IMPL(getxattr);
+    IMPL(init);
+    IMPL(destroy);
 #undef IMPL
 }
 
@@ -357,6 +1160,9 @@ enum
     KEY_HELP,
     KEY_VERSION,
     KEY_EXTENSIONS,
+    KEY_SCAN_EXTENSIONS,
+    KEY_EXCLUDE,
+    KEY_INCLUDE,
     KEY_ALIASES,
 };
 
@@ -384,15 +1190,95 @@ void usage()
         "                               %track% - %title%.%ext%\"\n"
         "   -o database=<path>      Path to the database file to be used. Defaults to\n"
         "                               music.db in the current directory.\n"
+        "   -o tag_cache=<path>     Path to a cache of file tags, which can be shared by\n"
+        "                               several databases. Files that are unchanged\n"
+        "                               since they were cached don't have to be read\n"
+        "                               again, even by a new database.\n"
         "   -o extensions=<list>    Semicolon-delimited list of file extensions. When\n"
         "                               multiple files are available for the same\n"
         "                               track, extensions earlier in this list will be\n"
         "                               given precedence and hide the others. End with\n"
         "                               a '*' to include un-matched files. Defaults to\n"
         "                               \"flac;mp3;*\"\n"
+        "   -o scan_extensions=<list>\n"
+        "                           Semicolon-delimited list of file extensions to\n"
+        "                               scan for tags. Defaults to\n"
+        "                               \"mp3;flac;wma;m4a;mp4;ogg\"\n"
+        "   -o exclude=<list>       Semicolon-delimited list of glob patterns of files\n"
+        "                               and directories to skip when scanning. A\n"
+        "                               pattern containing a '/' is matched against\n"
+        "                               the path relative to the backing directory,\n"
+        "                               starting with '/'; otherwise only against the\n"
+        "                               name. Common NAS and OS metadata directories\n"
+        "                               such as @eaDir and .AppleDouble are excluded\n"
+        "                               by default.\n"
+        "   -o include=<list>       Like exclude, but for files and directories to\n"
+        "                               scan even if an earlier pattern excluded them.\n"
+        "                               When patterns conflict, the last one wins.\n"
         "   -o aliases=<path>       Path to a file listing artist aliases. The file\n"
         "                               should list the canonical name first, followed\n"
         "                               by aliases indented on subsequent lines.\n"
+        "   -o physical_order       Read new files' tags in the order their data is\n"
+        "                               laid out on disk, instead of directory order.\n"
+        "                               Speeds up scanning on rotational disks.\n"
+        "   -o scan_ops=<n>         Limit the scan to n backing filesystem operations\n"
+        "                               per second while files are being read from\n"
+        "                               the mount. Unlimited by default.\n"
+        "   -o scan_bytes=<n>       Limit the scan to reading n bytes per second while\n"
+        "                               files are being read from the mount.\n"
+        "                               Unlimited by default.\n"
+        "   -o scan_latency=<ms>    Back off the scan's I/O rate when reads from the\n"
+        "                               mount take longer than this on average.\n"
+        "                               Defaults to 50.\n"
+        "   -o strict_scan          Check the modification time of every known file\n"
+        "                               at startup, even in backing directories that\n"
+        "                               are unchanged since the last scan.\n"
+        "   -o scan=<mode>          When to scan the backing directory for changes:\n"
+        "                               \"startup\" (the default) scans before\n"
+        "                               mounting. \"background\" mounts immediately\n"
+        "                               using the existing database, and applies the\n"
+        "                               scan's changes all at once when it finishes.\n"
+        "                               \"none\" mounts using the existing database\n"
+        "                               without scanning at all.\n"
+        "   -o revalidate           Check each file against the database the first\n"
+        "                               time it's accessed, and update the database\n"
+        "                               if the file has changed since it was scanned.\n"
+        "   -o passthrough          Have the kernel read files directly from the backing\n"
+        "                               FS, where it supports that (Linux 6.9 and\n"
+        "                               later; requires root). Reads that bypass\n"
+        "                               MusicFS don't count towards scan_latency.\n"
+        "                               Can't be used with block_cache, readahead,\n"
+        "                               header_cache or prefetch_next.\n"
+        "   -o fd_pool=<n>          Keep up to n backing files open, so files that are\n"
+        "                               opened again soon after being closed don't\n"
+        "                               have to be reopened. 0 closes them right away.\n"
+        "                               Defaults to 64.\n"
+        "   -o readahead=<n>        While a file is being read sequentially, read up to\n"
+        "                               n bytes ahead of the reader in the background.\n"
+        "                               For backing FSes with high latency, like network\n"
+        "                               filesystems. Off by default.\n"
+        "   -o prefetch_next=<pct>  Once pct percent of a file has been read, open the\n"
+        "                               next file in its directory and read its start\n"
+        "                               into the page cache, so playing an album\n"
+        "                               doesn't stall between tracks. Off by default.\n"
+        "   -o block_cache=<path>   Keep a copy of recently read parts of files in this\n"
+        "                               file, which should be on fast local storage,\n"
+        "                               for when the backing FS is slow or remote. It\n"
+        "                               persists across mounts.\n"
+        "   -o block_cache_size=<n> Size of the block cache, in bytes. Defaults to\n"
+        "                               1 GiB.\n"
+        "   -o header_cache=<n>     Keep the start and end of recently read files, where\n"
+        "                               their tags are, in up to n bytes of memory, so\n"
+        "                               media servers refreshing their libraries don't\n"
+        "                               hit the backing FS. Off by default.\n"
+        "   -o entry_timeout=<s>    How long the kernel may cache names in the mount,\n"
+        "   -o attr_timeout=<s>         their attributes, and the fact that names\n"
+        "   -o negative_timeout=<s>     don't exist, in seconds. Default to 1. When\n"
+        "                               any are longer, or with keep_cache, MusicFS\n"
+        "                               tells the kernel what changes when the\n"
+        "                               database does.\n"
+        "   -o keep_cache           Keep files' contents cached in the kernel when\n"
+        "                               they're opened again.\n"
         "   -o\n"
         "   -v\n"
         "   --verbose               Enable informational messages.\n"
@@ -407,7 +1293,29 @@ static fuse_opt musicfs_opts_spec[] = {
     { "backing_fs=%s",  offsetof(struct musicfs_opts, backing_fs),      0 },
     { "pattern=%s",     offsetof(struct musicfs_opts, pattern),         0 },
     { "database=%s",    offsetof(struct musicfs_opts, database_path),   0 },
+    { "tag_cache=%s",   offsetof(struct musicfs_opts, tag_cache_path),  0 },
+    { "strict_scan",    offsetof(struct musicfs_opts, strict_scan),     1 },
+    { "physical_order", offsetof(struct musicfs_opts, physical_order),  1 },
+    { "scan_ops=%u",    offsetof(struct musicfs_opts, scan_ops),        0 },
+    { "scan_bytes=%lu", offsetof(struct musicfs_opts, scan_bytes),      0 },
+    { "scan_latency=%u", offsetof(struct musicfs_opts, scan_latency),   0 },
+    { "scan=%s",        offsetof(struct musicfs_opts, scan_mode),       0 },
+    { "revalidate",     offsetof(struct musicfs_opts, revalidate),      1 },
+    { "passthrough",    offsetof(struct musicfs_opts, passthrough),     1 },
+    { "fd_pool=%u",     offsetof(struct musicfs_opts, fd_pool_size),    0 },
+    { "readahead=%lu",  offsetof(struct musicfs_opts, readahead),       0 },
+    { "prefetch_next=%u", offsetof(struct musicfs_opts, prefetch_next), 0 },
+    { "block_cache=%s", offsetof(struct musicfs_opts, block_cache_path), 0 },
+    { "block_cache_size=%lu", offsetof(struct musicfs_opts, block_cache_size), 0 },
+    { "header_cache=%lu", offsetof(struct musicfs_opts, header_cache_size), 0 },
+    { "entry_timeout=%lf", offsetof(struct musicfs_opts, entry_timeout), 0 },
+    { "attr_timeout=%lf", offsetof(struct musicfs_opts, attr_timeout), 0 },
+    { "negative_timeout=%lf", offsetof(struct musicfs_opts, negative_timeout), 0 },
+    { "keep_cache",     offsetof(struct musicfs_opts, keep_cache),      1 },
     FUSE_OPT_KEY("extensions=%s", KEY_EXTENSIONS),
+    FUSE_OPT_KEY("scan_extensions=%s", KEY_SCAN_EXTENSIONS),
+    FUSE_OPT_KEY("exclude=%s",  KEY_EXCLUDE),
+    FUSE_OPT_KEY("include=%s",  KEY_INCLUDE),
     FUSE_OPT_KEY("aliases=%s",  KEY_ALIASES),
     FUSE_OPT_KEY("verbose",     KEY_VERBOSE),
     FUSE_OPT_KEY("-v",          KEY_VERBOSE),
@@ -425,6 +1333,18 @@ static fuse_opt musicfs_opts_spec[] = {
 int num_nonopt_args_read = 0;
 char * nonopt_arguments[2] = { nullptr, nullptr };
 
+// Splits the value of a "name=value1;value2;..." option.
+static vector<string> option_value_list(const char *arg)
+{
+    // Skip to the '='.
+    while (*arg != '\0' && *arg != '=')
+        arg++;
+    if (*arg == '=')
+        arg++;
+
+    return split(arg, ';');
+}
+
 int musicfs_opt_proc(void *data, const char *arg, int key,
         fuse_args *outargs)
 {
@@ -453,26 +1373,31 @@ int musicfs_opt_proc(void *data, const char *arg, int key,
         break;
 
     case KEY_EXTENSIONS:
-        // Skip to the '='.
-        while (*arg != '\0' && *arg != '=')
-            arg++;
-        if (*arg == '=')
-            arg++;
-
-        for (size_t start = 0, end = 0; ; end++)
+        for (string& ext : option_value_list(arg))
         {
-            if (arg[end] == ';' || arg[end] == '\0')
+            if (ext != "*")
             {
-                string ext(arg + start, (end - start));
-                if (ext != "*")
-                {
-                    ext = "." + ext;
-                }
-                musicfs.extension_priority.push_back(ext);
-                start = end + 1;
+                ext = "." + ext;
             }
-            if (arg[end] == '\0')
-                break;
+            musicfs.extension_priority.push_back(ext);
+        }
+        break;
+
+    case KEY_SCAN_EXTENSIONS:
+        musicfs.scan_filter.SetExtensions(option_value_list(arg));
+        break;
+
+    case KEY_EXCLUDE:
+        for (const string& glob : option_value_list(arg))
+        {
+            musicfs.scan_filter.AddRule(glob, true);
+        }
+        break;
+
+    case KEY_INCLUDE:
+        for (const string& glob : option_value_list(arg))
+        {
+            musicfs.scan_filter.AddRule(glob, false);
         }
         break;
 
@@ -496,15 +1421,14 @@ int musicfs_opt_proc(void *data, const char *arg, int key,
         return FUSE_OPT_DISCARD;
 
     case KEY_HELP:
-        fuse_opt_add_arg(outargs, "-h");
         usage();
-        fuse_main(outargs->argc, outargs->argv, &MusicFS_Opers, nullptr);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
         exit(1);
 
     case KEY_VERSION:
         cerr << "MusicFS: " << MUSICFS_VERSION << endl;
-        fuse_opt_add_arg(outargs, "--version");
-        fuse_main(outargs->argc, outargs->argv, &MusicFS_Opers, nullptr);
+        fuse_lowlevel_version();
         exit(0);
 
     default:
@@ -524,6 +1448,12 @@ int main(int argc, char **argv)
 
     fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+    musicfs.fd_pool_size = 64;
+    musicfs.entry_timeout = s_defaultTimeout;
+    musicfs.attr_timeout = s_defaultTimeout;
+    musicfs.negative_timeout = s_defaultTimeout;
+    musicfs.block_cache_size = 1024 * 1024 * 1024;
+
     if (fuse_opt_parse(&args, &musicfs, musicfs_opts_spec, musicfs_opt_proc) == -1)
     {
         cerr << "MusicFS: argument parsing failed.\n";
@@ -542,11 +1472,30 @@ int main(int argc, char **argv)
     {
         cerr << "MusicFS: error: you need to specify a mount point.\n";
         usage();
-        fuse_opt_add_arg(&args, "-ho");
-        fuse_main(args.argc, args.argv, &MusicFS_Opers, nullptr);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
         return -1;
     }
 
+    bool background_scan = false;
+    bool no_scan = false;
+    if (musicfs.scan_mode != nullptr)
+    {
+        if (strcmp(musicfs.scan_mode, "background") == 0)
+        {
+            background_scan = true;
+        }
+        else if (strcmp(musicfs.scan_mode, "none") == 0)
+        {
+            no_scan = true;
+        }
+        else if (strcmp(musicfs.scan_mode, "startup") != 0)
+        {
+            cerr << "MusicFS: unknown scan mode \"" << musicfs.scan_mode << "\".\n";
+            return -1;
+        }
+    }
+
     if (musicfs.pattern == nullptr)
     {
         musicfs.pattern = const_cast<char*>(default_pattern);
@@ -601,23 +1550,265 @@ int main(int argc, char **argv)
         }
     }
 
-    db.BeginTransaction();
+    unique_ptr<ScanScheduler> scheduler;
+    if (musicfs.scan_ops != 0 || musicfs.scan_bytes != 0)
+    {
+        if (musicfs.scan_latency == 0)
+            musicfs.scan_latency = 50;
 
-    cout << "Groveling music. This may take a while...\n";
-    vector<pair<int,int>> groveled_ids = grovel(musicfs.backing_fs, db);
+        INFO("Scan I/O budget: " << musicfs.scan_ops << " ops/sec, " << musicfs.scan_bytes << " bytes/sec");
+        scheduler.reset(new ScanScheduler(musicfs.scan_ops, musicfs.scan_bytes, musicfs.scan_latency));
+        musicfs.scheduler = scheduler.get();
+    }
 
-    db.EndTransaction();
-    db.BeginTransaction();
+    unique_ptr<TagCache> tagCache;
+    if (musicfs.tag_cache_path != nullptr)
+    {
+        cout << "Opening tag cache (" << musicfs.tag_cache_path << ")...\n";
+        tagCache.reset(new TagCache(musicfs.tag_cache_path));
+    }
 
-    cout << "Computing paths...\n";
-    build_paths(db, pathPattern, groveled_ids, aliases);
+    GrovelOptions grovelOptions;
+    grovelOptions.strict = (musicfs.strict_scan != 0);
+    grovelOptions.physical_order = (musicfs.physical_order != 0);
+    grovelOptions.scheduler = musicfs.scheduler;
+    grovelOptions.tag_cache = tagCache.get();
+    grovelOptions.filter = &musicfs.scan_filter;
+    grovelOptions.cancel = &s_cancelScan;
 
-    db.EndTransaction();
+    if (background_scan && !db.HasPaths())
+    {
+        INFO("Database is empty; scanning before mounting.");
+        background_scan = false;
+    }
 
-    cout << "Ready to go!\n";
-    musicfs.startup_time = time(nullptr);
-    musicfs.db = &db;
-    fuse_main(args.argc, args.argv, &MusicFS_Opers, nullptr);
+    // Held by the background scan and rescans, so only one runs at a time.
+    mutex scanLock;
 
-    return 0;
+    if (no_scan)
+    {
+        if (!db.HasPaths())
+            WARN("Database is empty, and scanning is disabled.");
+    }
+    else if (background_scan)
+    {
+        cout << "Mounting from the existing database; scanning in the background.\n";
+        s_backgroundScan = [&]()
+        {
+            INFO("Background scan starting.");
+            lock_guard<mutex> lock(scanLock);
+            try
+            {
+                // Use a separate connection, so the filesystem keeps seeing the old state until
+                // the scan's transaction commits.
+                MusicDatabase scanDb(database_path);
+                if (scan_library(musicfs.backing_fs, scanDb, grovelOptions, pathPattern, aliases))
+                {
+                    musicfs.lookup_filter->Invalidate();
+                    if (musicfs.invalidator != nullptr)
+                        musicfs.invalidator->Sync();
+                    INFO("Background scan finished.");
+                }
+            }
+            catch (exception *)
+            {
+                ERROR("Background scan failed.");
+            }
+        };
+    }
+    else
+    {
+        cout << "Groveling music. This may take a while...\n";
+        scan_library(musicfs.backing_fs, db, grovelOptions, pathPattern, aliases);
+    }
+
+    s_rescan = [&](const string& line) -> int
+    {
+        // Normalize to how directory paths are stored: starting with a slash, but not ending in one.
+        vector<string> components;
+        for (const string& component : split(line.c_str(), '/'))
+        {
+            if (component == "." || component == "..")
+            {
+                ERROR("rescan: \"" << line << "\" isn't a plain path in the backing FS.");
+                return -EINVAL;
+            }
+            if (!component.empty())
+                components.push_back(component);
+        }
+
+        GrovelOptions rescanOptions = grovelOptions;
+        for (const string& component : components)
+        {
+            rescanOptions.directory += "/" + component;
+        }
+
+        // The directory was changed on purpose, so don't trust the mtimes of files in it. Don't use
+        // the tag cache; it isn't safe to share with a background scan, and new files won't be in
+        // it anyway.
+        rescanOptions.strict = true;
+        rescanOptions.tag_cache = nullptr;
+
+        // The writer is waiting in close(), so if another scan is under way, whether in this
+        // process or another, say so rather than waiting what may be minutes for it to finish.
+        rescanOptions.fail_if_busy = true;
+        unique_lock<mutex> lock(scanLock, try_to_lock);
+        if (!lock.owns_lock())
+        {
+            INFO("Not rescanning " << rescanOptions.directory << "; another scan is running.");
+            return -EBUSY;
+        }
+
+        INFO("Rescanning " << musicfs.backing_fs << rescanOptions.directory);
+        try
+        {
+            MusicDatabase rescanDb(database_path);
+            if (!scan_library(musicfs.backing_fs, rescanDb, rescanOptions, pathPattern, aliases))
+                return s_cancelScan ? -EINTR : -EBUSY;
+            musicfs.lookup_filter->Invalidate();
+            if (musicfs.invalidator != nullptr)
+                musicfs.invalidator->Sync();
+        }
+        catch (exception *)
+        {
+            ERROR("Rescan of " << rescanOptions.directory << " failed.");
+            return -EIO;
+        }
+        return 0;
+    };
+
+    unique_ptr<Revalidator> revalidator;
+    if (musicfs.revalidate)
+    {
+        revalidator.reset(new Revalidator(musicfs.backing_fs, db, database_path, pathPattern, aliases,
+            []()
+            {
+                // The changes were made with another connection, so they'd otherwise only be
+                // noticed by polling.
+                musicfs.lookup_filter->Invalidate();
+                if (musicfs.invalidator != nullptr)
+                    musicfs.invalidator->Request();
+            }));
+        musicfs.revalidator = revalidator.get();
+    }
+
+    LookupFilter lookupFilter(db);
+    musicfs.lookup_filter = &lookupFilter;
+
+    unique_ptr<CacheInvalidator> invalidator;
+    if (musicfs.keep_cache
+        || musicfs.entry_timeout > s_defaultTimeout
+        || musicfs.attr_timeout > s_defaultTimeout
+        || musicfs.negative_timeout > s_defaultTimeout)
+    {
+        invalidator.reset(new CacheInvalidator(db,
+            [](int parent_id, const string& name)
+            {
+                return fuse_lowlevel_notify_inval_entry(s_session, ino_from_path_id(parent_id),
+                    name.c_str(), name.size());
+            },
+            [](int path_id)
+            {
+                return fuse_lowlevel_notify_inval_inode(s_session, ino_from_path_id(path_id), 0, 0);
+            },
+            &lookupFilter));
+        musicfs.invalidator = invalidator.get();
+    }
+
+    FdPool fdPool(musicfs.fd_pool_size);
+    musicfs.fd_pool = &fdPool;
+
+    unique_ptr<ReadAheadEngine> readAhead;
+    if (musicfs.readahead != 0)
+    {
+        INFO("Reading up to " << musicfs.readahead << " bytes ahead.");
+        readAhead.reset(new ReadAheadEngine(musicfs.readahead));
+        musicfs.read_ahead = readAhead.get();
+    }
+
+    unique_ptr<TrackPrefetcher> prefetcher;
+    if (musicfs.prefetch_next != 0)
+    {
+        if (musicfs.prefetch_next > 100)
+        {
+            cerr << "MusicFS: prefetch_next is a percentage, and can't be more than 100.\n";
+            return -1;
+        }
+        prefetcher.reset(new TrackPrefetcher(musicfs.backing_fs, db, fdPool, file_preference, s_prefetchBytes));
+        musicfs.prefetcher = prefetcher.get();
+    }
+
+    unique_ptr<BlockCache> blockCache;
+    if (musicfs.block_cache_path != nullptr)
+    {
+        cout << "Opening block cache (" << musicfs.block_cache_path << ")...\n";
+        blockCache.reset(new BlockCache(musicfs.block_cache_path, musicfs.block_cache_size));
+        musicfs.block_cache = blockCache.get();
+    }
+
+    unique_ptr<HeaderCache> headerCache;
+    if (musicfs.header_cache_size != 0)
+    {
+        INFO("Caching file headers in up to " << musicfs.header_cache_size << " bytes.");
+        headerCache.reset(new HeaderCache(musicfs.header_cache_size));
+        musicfs.header_cache = headerCache.get();
+    }
+
+#ifndef FUSE_CAP_PASSTHROUGH
+    if (musicfs.passthrough)
+    {
+        WARN("This build's libfuse doesn't support passthrough (3.16 or later is needed); "
+            "reading files through MusicFS.");
+        musicfs.passthrough = 0;
+    }
+#endif
+
+    // Passed-through reads never reach MusicFS, so these would never be used.
+    if (musicfs.passthrough && (musicfs.block_cache != nullptr || musicfs.read_ahead != nullptr
+        || musicfs.header_cache != nullptr || musicfs.prefetcher != nullptr))
+    {
+        cerr << "MusicFS: passthrough can't be used with block_cache, readahead, header_cache or "
+            "prefetch_next.\n";
+        return 1;
+    }
+
+    fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) == -1)
+    {
+        cerr << "MusicFS: argument parsing failed.\n";
+        return 1;
+    }
+
+    fuse_session *se = fuse_session_new(&args, &MusicFS_Opers, sizeof(MusicFS_Opers), nullptr);
+    if (se == nullptr)
+    {
+        free(opts.mountpoint);
+        return 1;
+    }
+    s_session = se;
+
+    int result = 1;
+    if (fuse_set_signal_handlers(se) != -1)
+    {
+        if (fuse_session_mount(se, opts.mountpoint) == 0)
+        {
+            cout << "Ready to go!\n";
+            musicfs.startup_time = time(nullptr);
+            musicfs.db = &db;
+            db.SetProfiler(op_stats_record_query);
+
+            fuse_daemonize(opts.foreground);
+
+            result = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+
+            fuse_session_unmount(se);
+        }
+        fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return (result == 0) ? 0 : 1;
 }
@@ -83,3 +83,16 @@ string MusicInfo::extension() const
     string filename = m_fileRef.file()->name();
     return filename.substr(filename.find_last_of(".") + 1);
 }
+
+MusicTags MusicInfo::tags() const
+{
+    MusicTags tags;
+    tags.title = title();
+    tags.artist = artist();
+    tags.album = album();
+    tags.albumartist = albumartist();
+    tags.disc = disc();
+    tags.year = year();
+    tags.track = track();
+    return tags;
+}
@@ -8,6 +8,14 @@
 
 #include <taglib/fileref.h>
 
+// The tag values MusicFS keeps for a file, detached from TagLib.
+struct MusicTags
+{
+    std::string title, artist, album, albumartist, disc;
+    unsigned int year = 0;
+    unsigned int track = 0;
+};
+
 class MusicInfo
 {
 public:
@@ -28,6 +36,8 @@ public:
     std::string albumartist() const;
     std::string disc() const;
 
+    MusicTags tags() const;
+
 private:
     const TagLib::FileRef m_fileRef;
     std::string property(const std::string& name) const;
@@ -0,0 +1,238 @@
+//
+// MusicFS :: Per-Operation Latency Statistics
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "op_stats.h"
+
+using namespace std;
+
+static const char *s_opNames[] = { "lookup", "getattr", "readdir", "open", "read", "getxattr" };
+static const size_t s_numOps = sizeof(s_opNames) / sizeof(s_opNames[0]);
+
+// Bucket 0 counts latencies under 1 microsecond; bucket i, those under 2^i microseconds. The
+// last one counts everything longer, too.
+static const size_t s_numBuckets = 24;
+
+// One thread's counts. Only the owning thread writes to them, so plain loads and stores suffice;
+// they're atomic so they can be read from other threads meanwhile.
+struct Counter
+{
+    atomic<unsigned long long> value;
+
+    void Add(unsigned long long n)
+    {
+        value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    unsigned long long Get() const
+    {
+        return value.load(memory_order_relaxed);
+    }
+};
+
+struct OpCounters
+{
+    Counter count;
+    Counter ns;
+    Counter queries;
+    Counter queryNs;
+    Counter maxNs;
+    Counter buckets[s_numBuckets];
+};
+
+struct Slot
+{
+    OpCounters ops[s_numOps];
+};
+
+// Slots are never freed, so reports can read them without coordinating with their threads. When
+// a thread exits, its slot (counts and all) is handed to the next new thread.
+static mutex s_slotsLock;
+static vector<unique_ptr<Slot>> s_slots;
+static vector<Slot*> s_freeSlots;
+
+struct ThreadSlot
+{
+    Slot *slot;
+
+    ThreadSlot()
+    {
+        lock_guard<mutex> lock(s_slotsLock);
+        if (s_freeSlots.empty())
+        {
+            s_slots.emplace_back(new Slot());
+            slot = s_slots.back().get();
+        }
+        else
+        {
+            slot = s_freeSlots.back();
+            s_freeSlots.pop_back();
+        }
+    }
+
+    ~ThreadSlot()
+    {
+        lock_guard<mutex> lock(s_slotsLock);
+        s_freeSlots.push_back(slot);
+    }
+};
+
+static thread_local ThreadSlot t_slot;
+
+// The operation this thread is timing, or -1.
+static thread_local int t_currentOp = -1;
+
+static size_t bucket_for(unsigned long long ns)
+{
+    unsigned long long us = ns / 1000;
+    size_t bucket = 0;
+    while (us != 0 && bucket < s_numBuckets - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+OpTimer::OpTimer(FuseOp op)
+    : m_op(op)
+    , m_outerOp(t_currentOp)
+    , m_start(chrono::steady_clock::now())
+{
+    t_currentOp = static_cast<int>(op);
+}
+
+OpTimer::~OpTimer()
+{
+    unsigned long long ns = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - m_start).count();
+
+    OpCounters& counters = t_slot.slot->ops[static_cast<int>(m_op)];
+    counters.count.Add(1);
+    counters.ns.Add(ns);
+    counters.buckets[bucket_for(ns)].Add(1);
+    if (ns > counters.maxNs.Get())
+        counters.maxNs.value.store(ns, memory_order_relaxed);
+
+    t_currentOp = m_outerOp;
+}
+
+void op_stats_record_query(unsigned long long ns)
+{
+    if (t_currentOp == -1)
+        return;
+
+    OpCounters& counters = t_slot.slot->ops[t_currentOp];
+    counters.queries.Add(1);
+    counters.queryNs.Add(ns);
+}
+
+// The upper bound of the bucket the given fraction of calls fall within, in microseconds.
+static unsigned long long percentile_us(const unsigned long long *buckets, unsigned long long count, double fraction)
+{
+    unsigned long long target = static_cast<unsigned long long>(count * fraction);
+    unsigned long long seen = 0;
+    for (size_t i = 0; i < s_numBuckets; i++)
+    {
+        seen += buckets[i];
+        if (seen > target)
+            return 1ull << i;
+    }
+    return 1ull << (s_numBuckets - 1);
+}
+
+// An operation's counts, summed over all threads.
+struct OpTotals
+{
+    unsigned long long count;
+    unsigned long long ns;
+    unsigned long long queries;
+    unsigned long long queryNs;
+    unsigned long long maxNs;
+    unsigned long long buckets[s_numBuckets];
+};
+
+string op_stats_report()
+{
+    OpTotals totals[s_numOps] = {};
+    size_t threads;
+    {
+        lock_guard<mutex> lock(s_slotsLock);
+        threads = s_slots.size() - s_freeSlots.size();
+        for (const auto& slot : s_slots)
+        {
+            for (size_t op = 0; op < s_numOps; op++)
+            {
+                const OpCounters& counters = slot->ops[op];
+                OpTotals& total = totals[op];
+                total.count += counters.count.Get();
+                total.ns += counters.ns.Get();
+                total.queries += counters.queries.Get();
+                total.queryNs += counters.queryNs.Get();
+                total.maxNs = max(total.maxNs, counters.maxNs.Get());
+                for (size_t i = 0; i < s_numBuckets; i++)
+                    total.buckets[i] += counters.buckets[i].Get();
+            }
+        }
+    }
+
+    stringstream ss;
+    ss << fixed << setprecision(1);
+    ss << "threads: " << threads << "\n\n";
+    ss << left << setw(10) << "op" << right
+        << setw(10) << "count"
+        << setw(10) << "mean_us"
+        << setw(10) << "p50_us"
+        << setw(10) << "p90_us"
+        << setw(10) << "p99_us"
+        << setw(10) << "max_us"
+        << setw(10) << "queries"
+        << setw(10) << "query_us"
+        << "\n";
+    for (size_t op = 0; op < s_numOps; op++)
+    {
+        const OpTotals& total = totals[op];
+        unsigned long long count = total.count;
+        ss << left << setw(10) << s_opNames[op] << right
+            << setw(10) << count
+            << setw(10) << (count == 0 ? 0.0 : static_cast<double>(total.ns) / count / 1000)
+            << setw(10) << (count == 0 ? 0 : percentile_us(total.buckets, count, 0.5))
+            << setw(10) << (count == 0 ? 0 : percentile_us(total.buckets, count, 0.9))
+            << setw(10) << (count == 0 ? 0 : percentile_us(total.buckets, count, 0.99))
+            << setw(10) << total.maxNs / 1000
+            << setw(10) << total.queries
+            << setw(10) << (count == 0 ? 0.0 : static_cast<double>(total.queryNs) / count / 1000)
+            << "\n";
+    }
+
+    // Histograms, leaving out empty buckets.
+    ss << "\nlatency histograms (calls under each number of microseconds):\n";
+    for (size_t op = 0; op < s_numOps; op++)
+    {
+        const OpTotals& total = totals[op];
+        ss << s_opNames[op] << ":";
+        for (size_t i = 0; i < s_numBuckets; i++)
+        {
+            if (total.buckets[i] == 0)
+                continue;
+            if (i == s_numBuckets - 1)
+                ss << " more=" << total.buckets[i];
+            else
+                ss << " " << (1ull << i) << "=" << total.buckets[i];
+        }
+        ss << "\n";
+    }
+    return ss.str();
+}
@@ -0,0 +1,46 @@
+//
+// MusicFS :: Per-Operation Latency Statistics
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <chrono>
+#include <string>
+
+// The FUSE callbacks whose latency is tracked.
+enum class FuseOp
+{
+    Lookup,
+    Getattr,
+    Readdir,
+    Open,
+    Read,
+    Getxattr,
+};
+
+// Times a callback, from construction to destruction, and counts it in a histogram of latencies
+// for its operation, along with how much of that time was spent in database queries. Each thread
+// keeps its own counts, which only it writes to, so this costs a couple of clock reads and no
+// locking or contended memory per callback.
+class OpTimer
+{
+public:
+    OpTimer(FuseOp op);
+    ~OpTimer();
+
+    OpTimer(const OpTimer&) = delete;
+    OpTimer& operator=(const OpTimer&) = delete;
+
+private:
+    FuseOp m_op;
+    int m_outerOp;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Adds the time a database query took to the callback running on this thread, if there is one.
+void op_stats_record_query(unsigned long long ns);
+
+// Counts, percentiles and histograms for each operation, summed over all threads, as text.
+std::string op_stats_report();
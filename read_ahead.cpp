@@ -0,0 +1,326 @@
+//
+// MusicFS :: Read-Ahead for Slow Backing Storage
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MUSICFS_LOG_SUBSYS "ReadAhead"
+#include "logging.h"
+
+#include "read_ahead.h"
+
+using namespace std;
+
+// How far ahead a file is read once it starts being read sequentially. This is about what the
+// kernel asks for at once, so the first fetch is already one read ahead of it.
+static const size_t s_initialWindow = 128 * 1024;
+
+// Windows are fetched in pieces no bigger than this, each a job of its own, so one file reading
+// far ahead doesn't keep the workers from the others for long.
+static const size_t s_maxFetch = 256 * 1024;
+
+ReadAheadEngine::ReadAheadEngine(size_t max_window, unsigned int threads)
+    : m_maxWindow(max_window)
+    , m_numThreads(max(threads, 1u))
+    , m_stopping(false)
+    , m_bufferedBytes(0)
+    , m_directBytes(0)
+    , m_fetches(0)
+    , m_fetchedBytes(0)
+{
+}
+
+ReadAheadEngine::~ReadAheadEngine()
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+
+    for (thread& t : m_threads)
+    {
+        t.join();
+    }
+}
+
+void ReadAheadEngine::Submit(function<void()> job)
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (m_threads.empty())
+        {
+            for (unsigned int i = 0; i < m_numThreads; i++)
+            {
+                m_threads.emplace_back(&ReadAheadEngine::Worker, this);
+            }
+        }
+        m_jobs.push_back(move(job));
+    }
+    m_cv.notify_one();
+}
+
+void ReadAheadEngine::Worker()
+{
+    unique_lock<mutex> lock(m_lock);
+    for (;;)
+    {
+        m_cv.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+
+        // Finish everything queued before stopping; streams wait for their fetches.
+        if (m_jobs.empty())
+            return;
+
+        function<void()> job = move(m_jobs.front());
+        m_jobs.pop_front();
+
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+void ReadAheadEngine::RecordRead(size_t buffered_bytes, size_t direct_bytes)
+{
+    lock_guard<mutex> lock(m_lock);
+    m_bufferedBytes += buffered_bytes;
+    m_directBytes += direct_bytes;
+}
+
+void ReadAheadEngine::RecordFetch(size_t bytes)
+{
+    lock_guard<mutex> lock(m_lock);
+    m_fetches++;
+    m_fetchedBytes += bytes;
+}
+
+string ReadAheadEngine::GetState() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    unsigned long long total = m_bufferedBytes + m_directBytes;
+
+    stringstream ss;
+    ss << "max_window: " << m_maxWindow << "\n"
+        << "threads: " << m_threads.size() << "\n"
+        << "queued: " << m_jobs.size() << "\n"
+        << "buffered_bytes: " << m_bufferedBytes << "\n"
+        << "direct_bytes: " << m_directBytes << "\n"
+        << "hit_rate: " << (total == 0 ? 0.0 : static_cast<double>(m_bufferedBytes) / total) << "\n"
+        << "fetches: " << m_fetches << "\n"
+        << "fetched_bytes: " << m_fetchedBytes << "\n";
+    return ss.str();
+}
+
+ReadAheadStream::ReadAheadStream(ReadAheadEngine& engine, int fd)
+    : m_engine(engine)
+    , m_fd(fd)
+    , m_expected(0)
+    , m_window(min(s_initialWindow, engine.GetMaxWindow()))
+    , m_pending(0)
+    , m_eof(false)
+{
+}
+
+ReadAheadStream::~ReadAheadStream()
+{
+    // The fetches refer to this, so they have to finish first. Those not yet started are skipped.
+    unique_lock<mutex> lock(m_lock);
+    m_chunks.clear();
+    m_cv.wait(lock, [this]() { return m_pending == 0; });
+}
+
+ssize_t ReadAheadStream::Read(char *buf, size_t size, off_t offset)
+{
+    size_t buffered = 0;
+    bool eof = false;
+    {
+        unique_lock<mutex> lock(m_lock);
+
+        // With a multithreaded loop, the kernel's reads can arrive a little out of order, so
+        // anything that lands in the buffer counts as sequential too.
+        bool sequential = (offset == m_expected);
+        if (!m_chunks.empty()
+            && offset >= m_chunks.front()->offset
+            && offset < m_chunks.back()->offset + static_cast<off_t>(m_chunks.back()->data.size()))
+        {
+            sequential = true;
+        }
+
+        if (!sequential)
+        {
+            // Seeking; whatever was fetched is probably useless now. Fetches still in progress
+            // finish on their own, and those still queued are skipped.
+            m_chunks.clear();
+            m_window = min(s_initialWindow, m_engine.GetMaxWindow());
+            m_eof = false;
+        }
+
+        while (!m_chunks.empty()
+            && m_chunks.front()->offset + static_cast<off_t>(m_chunks.front()->data.size()) <= offset)
+        {
+            m_chunks.pop_front();
+        }
+
+        m_expected = offset + size;
+        if (sequential)
+        {
+            Schedule(m_expected);
+        }
+
+        while (buffered < size)
+        {
+            off_t pos = offset + buffered;
+            shared_ptr<Chunk> chunk;
+            for (const auto& c : m_chunks)
+            {
+                if (pos >= c->offset && pos < c->offset + static_cast<off_t>(c->data.size()))
+                {
+                    chunk = c;
+                    break;
+                }
+            }
+            if (!chunk)
+                break;
+
+            // Still queued, maybe behind other files' fetches; asking for it directly is quicker.
+            if (!chunk->started)
+                break;
+
+            // It's already on its way; waiting for it beats asking again.
+            m_cv.wait(lock, [&chunk]() { return chunk->done; });
+
+            // On errors, read directly, so the caller gets the error.
+            if (chunk->error != 0)
+                break;
+
+            off_t end = chunk->offset + chunk->length;
+            if (pos >= end)
+            {
+                eof = true;
+                break;
+            }
+
+            size_t n = min(size - buffered, static_cast<size_t>(end - pos));
+            memcpy(buf + buffered, chunk->data.data() + (pos - chunk->offset), n);
+            buffered += n;
+        }
+    }
+
+    ssize_t direct = 0;
+    if (!eof && buffered < size)
+    {
+        direct = pread(m_fd, buf + buffered, size - buffered, offset + buffered);
+        if (direct == -1)
+        {
+            if (buffered == 0)
+                return -1;
+            direct = 0;
+        }
+    }
+
+    m_engine.RecordRead(buffered, direct);
+    return buffered + direct;
+}
+
+void ReadAheadStream::Schedule(off_t readerPos)
+{
+    if (m_eof)
+        return;
+
+    off_t end = readerPos;
+    if (!m_chunks.empty())
+    {
+        end = max(end, m_chunks.back()->offset + static_cast<off_t>(m_chunks.back()->data.size()));
+    }
+
+    // Fetch another window's worth once the reader is within half a window of the end, so there's
+    // always a fetch in flight while it reads the rest.
+    if (static_cast<size_t>(end - readerPos) >= m_window / 2)
+        return;
+
+    for (size_t fetched = 0; fetched < m_window; )
+    {
+        auto chunk = make_shared<Chunk>();
+        chunk->offset = end + fetched;
+        chunk->data.resize(min(s_maxFetch, m_window - fetched));
+        chunk->length = 0;
+        chunk->started = false;
+        chunk->done = false;
+        chunk->error = 0;
+        fetched += chunk->data.size();
+
+        m_chunks.push_back(chunk);
+        m_pending++;
+        m_engine.Submit([this, chunk]() { Fetch(chunk); });
+    }
+
+    m_window = min(m_window * 2, m_engine.GetMaxWindow());
+}
+
+void ReadAheadStream::Fetch(shared_ptr<Chunk> chunk)
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+
+        // Dropped by a seek, or by the file being closed, while it was queued; nobody wants it.
+        if (find(m_chunks.begin(), m_chunks.end(), chunk) == m_chunks.end())
+        {
+            chunk->done = true;
+            m_pending--;
+            m_cv.notify_all();
+            return;
+        }
+
+        chunk->started = true;
+    }
+
+    size_t total = 0;
+    int error = 0;
+    while (total < chunk->data.size())
+    {
+        ssize_t n = pread(m_fd, chunk->data.data() + total, chunk->data.size() - total,
+            chunk->offset + total);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error = errno;
+            PERROR("read-ahead");
+            break;
+        }
+        if (n == 0)
+            break;
+        total += n;
+    }
+
+    m_engine.RecordFetch(total);
+
+    lock_guard<mutex> lock(m_lock);
+    chunk->length = total;
+    chunk->error = error;
+    chunk->done = true;
+    if (error == 0 && total < chunk->data.size()
+        && find(m_chunks.begin(), m_chunks.end(), chunk) != m_chunks.end())
+    {
+        m_eof = true;
+    }
+    m_pending--;
+    m_cv.notify_all();
+}
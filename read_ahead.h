@@ -0,0 +1,103 @@
+//
+// MusicFS :: Read-Ahead for Slow Backing Storage
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Worker threads that fetch data ahead of where files are being read, shared by all open files.
+class ReadAheadEngine
+{
+public:
+    // max_window is how far ahead of the reader any one file is read, at most.
+    ReadAheadEngine(size_t max_window, unsigned int threads = 4);
+    ~ReadAheadEngine();
+
+    ReadAheadEngine(const ReadAheadEngine&) = delete;
+    ReadAheadEngine& operator=(const ReadAheadEngine&) = delete;
+
+    size_t GetMaxWindow() const { return m_maxWindow; }
+
+    // Runs the job on a worker thread. The threads are started the first time this is called,
+    // rather than when the engine is created, so that they survive the process daemonizing.
+    void Submit(std::function<void()> job);
+
+    // Counters, updated by the streams.
+    void RecordRead(size_t buffered_bytes, size_t direct_bytes);
+    void RecordFetch(size_t bytes);
+
+    std::string GetState() const;
+
+private:
+    void Worker();
+
+    const size_t m_maxWindow;
+    const unsigned int m_numThreads;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_jobs;
+    std::vector<std::thread> m_threads;
+    bool m_stopping;
+
+    unsigned long long m_bufferedBytes;
+    unsigned long long m_directBytes;
+    unsigned long long m_fetches;
+    unsigned long long m_fetchedBytes;
+};
+
+// Read-ahead state for one open file. While it's read sequentially, data ahead of the reader is
+// fetched in the background into a buffer, and reads are answered from that; the distance read
+// ahead doubles each time the reader keeps up, up to the engine's maximum. Any other access
+// pattern goes straight to the file, as do reads of data whose fetch is still queued behind other
+// files' fetches.
+class ReadAheadStream
+{
+public:
+    ReadAheadStream(ReadAheadEngine& engine, int fd);
+    ~ReadAheadStream();
+
+    ReadAheadStream(const ReadAheadStream&) = delete;
+    ReadAheadStream& operator=(const ReadAheadStream&) = delete;
+
+    // Like pread: returns the number of bytes read, or -1 with errno set. Safe to call from
+    // several threads at once.
+    ssize_t Read(char *buf, size_t size, off_t offset);
+
+private:
+    struct Chunk
+    {
+        off_t offset;
+        std::vector<char> data;
+        size_t length;  // how much was actually read
+        bool started;   // a worker has begun reading it
+        bool done;
+        int error;      // errno value, or 0
+    };
+
+    // Starts fetching more, if the reader has gotten close enough to the end of the buffer.
+    // Called with m_lock held.
+    void Schedule(off_t readerPos);
+    void Fetch(std::shared_ptr<Chunk> chunk);
+
+    ReadAheadEngine& m_engine;
+    const int m_fd;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<std::shared_ptr<Chunk>> m_chunks; // in file order
+    off_t m_expected;       // where the next read is expected, if reading is sequential
+    size_t m_window;        // how far ahead of the reader to keep fetched
+    unsigned int m_pending; // fetches not yet finished
+    bool m_eof;             // a fetch reached the end of the file
+};
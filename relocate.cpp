@@ -0,0 +1,256 @@
+//
+// MusicFS :: Library Relocation
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#define MUSICFS_LOG_SUBSYS "Relocate"
+#include "logging.h"
+
+#include "database.h"
+#include "batch_stat.h"
+#include "relocate.h"
+
+using namespace std;
+
+// How many files from the database are checked for each candidate location.
+static const size_t s_sampleSize = 64;
+
+// How many of the sample files that couldn't be found are used to look for the library.
+static const size_t s_searchSamples = 4;
+
+// How deep, and through how many directories, to look for the library under the backing FS.
+static const size_t s_searchDepth = 3;
+static const size_t s_searchLimit = 2000;
+
+// Fraction of the sample that has to be found, unchanged, at a new location to accept it.
+static const double s_acceptFraction = 0.75;
+
+// Describes a move: paths starting with the old prefix now start with the new prefix instead.
+// Prefixes are either empty or a path starting with '/', just like paths in the database.
+typedef pair<string, string> Relocation;
+
+static string strip_trailing_slashes(string path)
+{
+    while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+    return path;
+}
+
+static bool has_prefix(const string& path, const string& prefix)
+{
+    return prefix.empty()
+        || (path.compare(0, prefix.size(), prefix) == 0 && path.size() > prefix.size() && path[prefix.size()] == '/');
+}
+
+// Counts how many of the sample files exist, with the same mtime, after applying the relocation.
+static size_t score(
+    BatchStat& statter,
+    const string& base_path,
+    const vector<pair<string, time_t>>& sample,
+    const Relocation& relocation
+    )
+{
+    vector<string> paths;
+    vector<time_t> mtimes;
+    for (const auto& file : sample)
+    {
+        if (!has_prefix(file.first, relocation.first))
+            continue;
+
+        paths.push_back(base_path + relocation.second + file.first.substr(relocation.first.size()));
+        mtimes.push_back(file.second);
+    }
+
+    vector<StatResult> results;
+    statter.Stat(paths, results);
+
+    size_t count = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (results[i].error == 0 && results[i].st.st_mtime == mtimes[i])
+            count++;
+    }
+    return count;
+}
+
+// Lists directories under the backing FS, breadth first, relative to it.
+static vector<string> list_directories(const string& base_path)
+{
+    vector<string> results;
+    deque<pair<string, size_t>> queue;
+    queue.emplace_back("", 0);
+
+    while (!queue.empty() && results.size() < s_searchLimit)
+    {
+        string partial_path = queue.front().first;
+        size_t depth = queue.front().second;
+        queue.pop_front();
+
+        results.push_back(partial_path);
+        if (depth == s_searchDepth)
+            continue;
+
+        DIR *dir = opendir((base_path + partial_path).c_str());
+        if (dir == nullptr)
+            continue;
+
+        dirent *e;
+        while ((e = readdir(dir)) != nullptr)
+        {
+            if (e->d_name[0] == '.')
+                continue;
+
+            string path = partial_path + "/" + e->d_name;
+            if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK)
+            {
+                struct stat s;
+                if (stat((base_path + path).c_str(), &s) != 0 || !S_ISDIR(s.st_mode))
+                    continue;
+            }
+            else if (e->d_type != DT_DIR)
+            {
+                continue;
+            }
+
+            queue.emplace_back(path, depth + 1);
+        }
+        closedir(dir);
+    }
+
+    return results;
+}
+
+bool relocate_library(const string& base_path_in, MusicDatabase& db)
+{
+    string base_path = strip_trailing_slashes(base_path_in);
+
+    string old_base_path;
+    bool have_old_base_path = db.GetSetting("backing_fs", old_base_path);
+    db.SetSetting("backing_fs", base_path);
+
+    vector<tuple<int, int, time_t, string, off_t>> db_files = db.GetFiles();
+    if (db_files.empty())
+        return false;
+
+    // Take files spread evenly over the whole table, so one missing directory doesn't skew it.
+    vector<pair<string, time_t>> sample;
+    size_t step = max(db_files.size() / s_sampleSize, static_cast<size_t>(1));
+    for (size_t i = 0; i < db_files.size() && sample.size() < s_sampleSize; i += step)
+    {
+        sample.emplace_back(get<3>(db_files[i]), get<2>(db_files[i]));
+    }
+
+    BatchStat statter;
+
+    size_t in_place = score(statter, base_path, sample, Relocation());
+    if (in_place * 2 >= sample.size())
+    {
+        // Most of the library is where we left it. Any missing files are just missing.
+        return false;
+    }
+
+    WARN("Only " << in_place << " of " << sample.size() << " sampled files were found; "
+        "looking for where the library went.");
+
+    set<Relocation> candidates;
+
+    // If the backing FS path moved up or down the same tree, that tells us exactly where to look.
+    old_base_path = strip_trailing_slashes(old_base_path);
+    if (have_old_base_path && old_base_path != base_path)
+    {
+        INFO("Backing FS was previously " << old_base_path);
+        if (has_prefix(old_base_path, base_path))
+            candidates.emplace("", old_base_path.substr(base_path.size()));
+        else if (has_prefix(base_path, old_base_path))
+            candidates.emplace(base_path.substr(old_base_path.size()), "");
+    }
+
+    // Otherwise, look for some of the missing files by trying each of their parent directories as
+    // the old root, under each directory near the top of the backing FS as the new root.
+    vector<string> directories;
+    size_t searched = 0;
+    for (const auto& file : sample)
+    {
+        if (searched == s_searchSamples)
+            break;
+
+        struct stat s;
+        if (stat((base_path + file.first).c_str(), &s) == 0)
+            continue;
+
+        if (directories.empty())
+            directories = list_directories(base_path);
+
+        searched++;
+        vector<Relocation> tries;
+        vector<string> paths;
+        for (size_t pos = 0; pos != string::npos && pos < file.first.size(); pos = file.first.find('/', pos + 1))
+        {
+            string old_prefix = file.first.substr(0, pos);
+            string rest = file.first.substr(pos);
+
+            for (const string& new_prefix : directories)
+            {
+                if (old_prefix == new_prefix)
+                    continue;
+
+                tries.emplace_back(old_prefix, new_prefix);
+                paths.push_back(base_path + new_prefix + rest);
+            }
+        }
+
+        vector<StatResult> results;
+        statter.Stat(paths, results);
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            if (results[i].error == 0 && results[i].st.st_mtime == file.second)
+            {
+                DEBUG("found " << file.first << " at " << paths[i]);
+                candidates.insert(tries[i]);
+            }
+        }
+    }
+
+    // On a tie, the first candidate wins, which is the one with the shortest prefixes, rather than
+    // one reached through some symlink.
+    Relocation best;
+    size_t best_score = 0;
+    for (const Relocation& candidate : candidates)
+    {
+        size_t found = score(statter, base_path, sample, candidate);
+        DEBUG("moving \"" << candidate.first << "\" to \"" << candidate.second << "\" finds "
+            << found << " of " << sample.size() << " files");
+        if (found > best_score)
+        {
+            best = candidate;
+            best_score = found;
+        }
+    }
+
+    if (best_score < sample.size() * s_acceptFraction)
+    {
+        WARN("Couldn't find the library under the backing FS; missing files will be removed.");
+        return false;
+    }
+
+    size_t moved = db.RelocateFiles(best.first, best.second);
+    INFO("Library moved: \"" << best.first << "\" is now \"" << best.second << "\"; "
+        "updated " << moved << " files (" << best_score << " of " << sample.size() << " sampled "
+        "files confirmed).");
+
+    return true;
+}
@@ -0,0 +1,18 @@
+//
+// MusicFS :: Library Relocation
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+class MusicDatabase;
+
+// Checks whether the files in the database are still where it says they are, relative to the
+// backing FS path. If most aren't, looks for them under the backing FS with some leading
+// directories removed or added (as when the library was moved into or out of a subdirectory, or
+// the backing FS path now names a different level of the same tree), and if that finds them,
+// rewrites the paths in the database so they don't all have to be scanned again.
+//
+// Returns whether the paths were rewritten.
+bool relocate_library(const std::string& base_path, MusicDatabase& db);
@@ -0,0 +1,163 @@
+//
+// MusicFS :: Lazy Revalidation of Files on Access
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/stat.h>
+
+#define MUSICFS_LOG_SUBSYS "Revalidator"
+#include "logging.h"
+
+#include "musicinfo.h"
+#include "database.h"
+#include "path_pattern.h"
+#include "aliases.h"
+#include "groveler.h"
+#include "revalidator.h"
+
+using namespace std;
+
+Revalidator::Revalidator(
+        const string& base_path,
+        MusicDatabase& db,
+        const string& database_path,
+        const PathPattern& pathPattern,
+        const ArtistAliases& aliases,
+        const function<void()>& updated
+        )
+    : m_basePath(base_path)
+    , m_db(db)
+    , m_pathPattern(pathPattern)
+    , m_aliases(aliases)
+    , m_updated(updated)
+    , m_updateDb(new MusicDatabase(database_path))
+{
+}
+
+Revalidator::~Revalidator()
+{
+}
+
+void Revalidator::Check(int path_id)
+{
+    try
+    {
+        int file_id;
+        string real_path;
+        struct stat known;
+        if (!m_db.GetFileForPath(path_id, &file_id, real_path, &known) || file_id == 0)
+            return;
+
+        {
+            lock_guard<mutex> lock(m_lock);
+            if (m_checked.count(file_id) != 0)
+                return;
+        }
+
+        // A mode of zero means the size wasn't recorded; getattr has to stat the file anyway then.
+        struct stat s;
+        if (stat((m_basePath + real_path).c_str(), &s) == 0
+            && s.st_mtime == known.st_mtime
+            && (known.st_mode == 0 || s.st_size == known.st_size))
+        {
+            lock_guard<mutex> lock(m_lock);
+            m_checked.insert(file_id);
+            return;
+        }
+
+        unique_lock<mutex> lock(m_updateLock, try_to_lock);
+        if (!lock.owns_lock())
+        {
+            DEBUG("another file is being revalidated; leaving path " << path_id << " for later");
+            return;
+        }
+
+        // Another thread may have gotten to it first.
+        int current_id;
+        if (!m_updateDb->GetFileForPath(path_id, &current_id, real_path) || current_id != file_id)
+            return;
+
+        Update(file_id, real_path);
+    }
+    catch (exception *)
+    {
+        ERROR("failed to revalidate path " << path_id);
+    }
+}
+
+void Revalidator::Update(int file_id, const string& real_path)
+{
+    string full_path = m_basePath + real_path;
+
+    if (!m_updateDb->TryBeginTransaction())
+    {
+        DEBUG("database is busy; leaving " << full_path << " for later");
+        return;
+    }
+
+    bool removed = true;
+    try
+    {
+        struct stat s;
+        if (stat(full_path.c_str(), &s) != 0)
+        {
+            PERROR("stat(" << full_path << ")");
+        }
+        else
+        {
+            MusicInfo info(full_path.c_str());
+            if (info.has_tag())
+            {
+                // Update it in place, so its path keeps its ID unless the new tags give it a
+                // different name. The kernel may know it by that ID already.
+                DEBUG("file has changed; updating DB: " << full_path);
+                int track_id = m_updateDb->UpdateFile(file_id, info.tags(), s);
+
+                vector<pair<int,int>> ids = { { track_id, file_id } };
+                vector<int> path_ids;
+                build_paths(*m_updateDb, m_pathPattern, ids, m_aliases, &path_ids);
+                m_updateDb->RemoveOtherPaths(file_id, path_ids[0]);
+                removed = false;
+            }
+            else
+            {
+                DEBUG("no tag: " << full_path);
+            }
+        }
+
+        if (removed)
+        {
+            DEBUG("removing from DB: " << full_path);
+            m_updateDb->RemoveFile(file_id);
+        }
+
+        m_updateDb->CleanTracks();
+        m_updateDb->CleanTables();
+        m_updateDb->CleanPaths();
+    }
+    catch (exception *)
+    {
+        m_updateDb->RollbackTransaction();
+        throw;
+    }
+    m_updateDb->EndTransaction();
+    m_updated();
+
+    if (!removed)
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_checked.insert(file_id);
+    }
+
+    INFO("revalidated " << full_path);
+}
@@ -0,0 +1,62 @@
+//
+// MusicFS :: Lazy Revalidation of Files on Access
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+class MusicDatabase;
+class PathPattern;
+class ArtistAliases;
+
+// Checks each file the first time it's accessed through the mount against its database entry,
+// and if the backing file has changed or gone away since it was scanned, updates the database
+// for just that file. This makes it reasonably safe to mount without scanning first.
+//
+// Updates are made through a connection of its own, and never wait: if a scan or another process
+// is writing to the database, or another request is already updating a file, the request goes
+// ahead with what the database has now, and the file is checked again on its next access.
+class Revalidator
+{
+public:
+    Revalidator(
+        const std::string& base_path,
+        MusicDatabase& db,
+        const std::string& database_path,
+        const PathPattern& pathPattern,
+        const ArtistAliases& aliases,
+        const std::function<void()>& updated
+        );
+    ~Revalidator();
+
+    Revalidator(const Revalidator&) = delete;
+    Revalidator& operator=(const Revalidator&) = delete;
+
+    // Call with a path ID before looking it up in the database. Afterwards, the database
+    // usually has up-to-date information for it. A changed file keeps its path ID, unless its
+    // new tags moved it elsewhere or it was removed.
+    void Check(int path_id);
+
+private:
+    void Update(int file_id, const std::string& real_path);
+
+    const std::string m_basePath;
+    MusicDatabase& m_db;
+    const PathPattern& m_pathPattern;
+    const ArtistAliases& m_aliases;
+    const std::function<void()> m_updated; // called after each update is committed
+
+    // Held while updating, which is done with m_updateDb.
+    std::mutex m_updateLock;
+    std::unique_ptr<MusicDatabase> m_updateDb;
+
+    std::mutex m_lock;
+    std::unordered_set<int> m_checked; // file IDs
+};
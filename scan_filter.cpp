@@ -0,0 +1,101 @@
+//
+// MusicFS :: Scan Include/Exclude Rules
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <fnmatch.h>
+#include <string.h>
+
+#include "scan_filter.h"
+
+using namespace std;
+
+static const char *s_defaultExtensions[] = {
+    "mp3", "flac", "wma", "m4a", "mp4", "ogg"
+};
+
+static const char *s_defaultExcludes[] = {
+    "@eaDir",           // Synology thumbnails and indexes
+    "#recycle",         // Synology recycle bin
+    "#snapshot",        // Synology snapshots
+    ".@__thumb",        // QNAP thumbnails
+    ".AppleDouble",     // Netatalk resource forks
+    "._*",              // macOS resource forks
+    ".Trash-*",         // freedesktop.org trash
+    ".git",
+    ".svn",
+    ".thumbnails",
+};
+
+ScanFilter::ScanFilter()
+{
+    for (const char *glob : s_defaultExcludes)
+        AddRule(glob, true);
+
+    for (const char *ext : s_defaultExtensions)
+        m_extensions.emplace(ext);
+}
+
+void ScanFilter::AddRule(const string& glob, bool exclude)
+{
+    m_rules.push_back(Rule{ glob, exclude, (glob.find('/') != string::npos) });
+}
+
+void ScanFilter::SetExtensions(const vector<string>& extensions)
+{
+    m_extensions.clear();
+    for (const string& ext : extensions)
+    {
+        string lower;
+        transform(ext.begin(), ext.end(), back_inserter(lower), ::tolower);
+        m_extensions.emplace(move(lower));
+    }
+}
+
+bool ScanFilter::IsExcluded(const string& partial_path, const char *name) const
+{
+    for (auto rule = m_rules.rbegin(); rule != m_rules.rend(); ++rule)
+    {
+        int result = rule->match_path
+            ? fnmatch(rule->glob.c_str(), partial_path.c_str(), FNM_PATHNAME)
+            : fnmatch(rule->glob.c_str(), name, 0);
+
+        if (result == 0)
+            return rule->exclude;
+    }
+    return false;
+}
+
+bool ScanFilter::HasWantedExtension(const char *name) const
+{
+    const char *dot = strrchr(name, '.');
+    if (dot == nullptr)
+        return false;
+
+    string ext(dot + 1);
+    for (char& c : ext)
+        c = ::tolower(c);
+
+    return (m_extensions.find(ext) != m_extensions.end());
+}
+
+string ScanFilter::GetFingerprint() const
+{
+    vector<string> extensions(m_extensions.begin(), m_extensions.end());
+    sort(extensions.begin(), extensions.end());
+
+    stringstream ss;
+    for (const string& ext : extensions)
+        ss << "." << ext << "\n";
+    for (const Rule& rule : m_rules)
+        ss << (rule.exclude ? "-" : "+") << rule.glob << "\n";
+    return ss.str();
+}
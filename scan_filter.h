@@ -0,0 +1,45 @@
+//
+// MusicFS :: Scan Include/Exclude Rules
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+class ScanFilter
+{
+public:
+    // Starts out with the default extensions, and rules excluding common NAS and OS junk.
+    ScanFilter();
+
+    // Rules are glob patterns. A pattern containing a '/' is matched against the whole path
+    // relative to the backing FS (which starts with a '/'); otherwise it is matched against the
+    // name only. When several rules match, the one added last wins.
+    void AddRule(const std::string& glob, bool exclude);
+
+    // Replaces the set of file extensions that are scanned. Case-insensitive, without the dot.
+    void SetExtensions(const std::vector<std::string>& extensions);
+
+    // Whether a file or directory should be skipped entirely.
+    bool IsExcluded(const std::string& partial_path, const char *name) const;
+
+    bool HasWantedExtension(const char *name) const;
+
+    // A description of the extensions and rules, which changes whenever what they select does.
+    std::string GetFingerprint() const;
+
+private:
+    struct Rule
+    {
+        std::string glob;
+        bool exclude;
+        bool match_path;
+    };
+
+    std::vector<Rule> m_rules;
+    std::unordered_set<std::string> m_extensions;
+};
@@ -0,0 +1,170 @@
+//
+// MusicFS :: I/O Budget for Background Scanning
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#define MUSICFS_LOG_SUBSYS "ScanScheduler"
+#include "logging.h"
+
+#include "scan_scheduler.h"
+
+using namespace std;
+
+// How often the rate is re-evaluated from the observed read latency.
+static const chrono::seconds s_adjustInterval(1);
+
+// How long without foreground reads before the mount is considered idle.
+static const chrono::seconds s_idleTime(5);
+
+// The rate never drops below this fraction of the budget, so scans always make progress.
+static const double s_minRate = 1.0 / 64;
+
+// Additive increase per adjustment interval while latency is acceptable.
+static const double s_rateStep = 1.0 / 16;
+
+ScanScheduler::ScanScheduler(unsigned int ops_per_sec, unsigned long bytes_per_sec, unsigned int latency_target_ms)
+    : m_maxOps(ops_per_sec)
+    , m_maxBytes(bytes_per_sec)
+    , m_latencyTarget(latency_target_ms)
+    , m_state(State::Idle)
+    , m_rate(1.0)
+    , m_opTokens(ops_per_sec)
+    , m_byteTokens(bytes_per_sec)
+    , m_lastRefill(clock::now())
+    , m_lastAdjust(m_lastRefill)
+    , m_lastRead()
+    , m_readLatencySum(0)
+    , m_readCount(0)
+    , m_lastReadLatency(0)
+    , m_totalOps(0)
+    , m_totalBytes(0)
+    , m_backoffs(0)
+    , m_throttled(clock::duration::zero())
+{
+}
+
+void ScanScheduler::Adjust(clock::time_point now)
+{
+    if (now - m_lastAdjust < s_adjustInterval)
+        return;
+
+    if (m_readCount == 0 && now - m_lastRead >= s_idleTime)
+    {
+        if (m_state != State::Idle)
+        {
+            INFO("mount is idle; scanning at full speed");
+            m_state = State::Idle;
+            m_rate = 1.0;
+        }
+    }
+    else
+    {
+        if (m_state == State::Idle)
+        {
+            INFO("foreground reads detected; limiting scan I/O");
+            m_state = State::Active;
+        }
+
+        double average = (m_readCount == 0) ? 0 : (m_readLatencySum / m_readCount);
+        if (m_latencyTarget > 0 && average > m_latencyTarget)
+        {
+            m_rate = max(m_rate / 2, s_minRate);
+            m_backoffs++;
+            DEBUG("read latency " << average << " ms over target; backing off to " << m_rate);
+        }
+        else
+        {
+            m_rate = min(m_rate + s_rateStep, 1.0);
+        }
+    }
+
+    m_readLatencySum = 0;
+    m_readCount = 0;
+    m_lastAdjust = now;
+}
+
+void ScanScheduler::Refill(clock::time_point now)
+{
+    double elapsed = chrono::duration<double>(now - m_lastRefill).count();
+    m_lastRefill = now;
+
+    // Allow at most one second's worth of burst.
+    m_opTokens = min(m_opTokens + elapsed * m_maxOps * m_rate, m_maxOps * m_rate);
+    m_byteTokens = min(m_byteTokens + elapsed * m_maxBytes * m_rate, m_maxBytes * m_rate);
+}
+
+void ScanScheduler::Acquire(size_t ops, size_t bytes)
+{
+    unique_lock<mutex> lock(m_lock);
+
+    m_totalOps += ops;
+    m_totalBytes += bytes;
+
+    clock::time_point now = clock::now();
+    Adjust(now);
+    Refill(now);
+
+    if (m_state == State::Idle)
+        return;
+
+    // Take the tokens now, going into debt if necessary, and then wait until the debt is repaid.
+    double wait = 0;
+    if (m_maxOps > 0)
+    {
+        m_opTokens -= ops;
+        if (m_opTokens < 0)
+            wait = max(wait, -m_opTokens / (m_maxOps * m_rate));
+    }
+    if (m_maxBytes > 0)
+    {
+        m_byteTokens -= bytes;
+        if (m_byteTokens < 0)
+            wait = max(wait, -m_byteTokens / (m_maxBytes * m_rate));
+    }
+
+    if (wait > 0)
+    {
+        auto duration = chrono::duration_cast<clock::duration>(chrono::duration<double>(wait));
+        m_throttled += duration;
+        lock.unlock();
+        this_thread::sleep_for(duration);
+    }
+}
+
+void ScanScheduler::RecordForegroundRead(clock::duration latency)
+{
+    double ms = chrono::duration<double, milli>(latency).count();
+
+    lock_guard<mutex> lock(m_lock);
+    m_lastRead = clock::now();
+    m_readLatencySum += ms;
+    m_readCount++;
+    m_lastReadLatency = ms;
+}
+
+string ScanScheduler::GetState() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    stringstream ss;
+    ss << "state: " << ((m_state == State::Idle) ? "idle" : "active") << "\n"
+        << "rate: " << m_rate << "\n"
+        << "ops_budget: " << m_maxOps << "\n"
+        << "bytes_budget: " << m_maxBytes << "\n"
+        << "latency_target_ms: " << m_latencyTarget << "\n"
+        << "last_read_latency_ms: " << m_lastReadLatency << "\n"
+        << "total_ops: " << m_totalOps << "\n"
+        << "total_bytes: " << m_totalBytes << "\n"
+        << "backoffs: " << m_backoffs << "\n"
+        << "throttled_ms: " << chrono::duration_cast<chrono::milliseconds>(m_throttled).count() << "\n";
+    return ss.str();
+}
@@ -0,0 +1,65 @@
+//
+// MusicFS :: I/O Budget for Background Scanning
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+
+class ScanScheduler
+{
+public:
+    // A limit of zero means that dimension is not limited.
+    ScanScheduler(unsigned int ops_per_sec, unsigned long bytes_per_sec, unsigned int latency_target_ms);
+
+    ScanScheduler(const ScanScheduler&) = delete;
+    ScanScheduler& operator=(const ScanScheduler&) = delete;
+
+    // Called by the scanner before doing I/O. Blocks until the budget allows it.
+    void Acquire(size_t ops, size_t bytes);
+
+    // Called by the filesystem after every read of a backing file.
+    void RecordForegroundRead(std::chrono::steady_clock::duration latency);
+
+    std::string GetState() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    enum class State
+    {
+        Idle,       // No recent foreground reads; budget is not enforced.
+        Active,     // Foreground reads are happening; running at some fraction of the budget.
+    };
+
+    void Adjust(clock::time_point now);
+    void Refill(clock::time_point now);
+
+    const double m_maxOps;
+    const double m_maxBytes;
+    const double m_latencyTarget;
+
+    mutable std::mutex m_lock;
+
+    State m_state;
+    double m_rate; // fraction of the configured budget currently allowed
+    double m_opTokens;
+    double m_byteTokens;
+    clock::time_point m_lastRefill;
+    clock::time_point m_lastAdjust;
+    clock::time_point m_lastRead;
+
+    // Foreground read latency accumulated since the last adjustment, in milliseconds.
+    double m_readLatencySum;
+    size_t m_readCount;
+    double m_lastReadLatency;
+
+    unsigned long long m_totalOps;
+    unsigned long long m_totalBytes;
+    unsigned long long m_backoffs;
+    clock::duration m_throttled;
+};
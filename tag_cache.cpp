@@ -0,0 +1,198 @@
+//
+// MusicFS :: Shared Tag Extraction Cache
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <sqlite3.h>
+
+#define MUSICFS_LOG_SUBSYS "TagCache"
+#include "logging.h"
+
+#include "musicinfo.h"
+#include "tag_cache.h"
+
+using namespace std;
+
+#define CHECKERR(_) CHECKERR_MSG(_, "SQL Error")
+#define CHECKERR_MSG(_, msg) \
+    do { \
+        if ((_) != SQLITE_OK) \
+        { \
+            ERROR(msg << " at " __FILE__ ":" << __LINE__  << ": " << sqlite3_errmsg(m_dbHandle)); \
+            throw new exception(); \
+        } \
+    } while(0)
+
+// Write out stores once this many are pending, or once the oldest has waited this long.
+static const size_t s_batchSize = 256;
+static const chrono::seconds s_batchInterval(2);
+
+struct TagCache::PendingStore
+{
+    struct stat s;
+    bool has_tag;
+    MusicTags tags;
+};
+
+static const char s_tableStatement[] =
+    "CREATE TABLE IF NOT EXISTS tags ( "
+        "device         INTEGER NOT NULL, "
+        "inode          INTEGER NOT NULL, "
+        "size           INTEGER NOT NULL, "
+        "mtime          INTEGER NOT NULL, "
+        "has_tag        INTEGER NOT NULL, "
+        "title          TEXT    NOT NULL, "
+        "artist         TEXT    NOT NULL, "
+        "album          TEXT    NOT NULL, "
+        "albumartist    TEXT    NOT NULL, "
+        "disc           TEXT    NOT NULL, "
+        "year           INTEGER NOT NULL, "
+        "track          INTEGER NOT NULL, "
+        "PRIMARY KEY(device, inode) "
+        ");";
+
+TagCache::TagCache(const string& cachePath)
+    : m_dbHandle(nullptr)
+    , m_lookup(nullptr)
+    , m_store(nullptr)
+{
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+    CHECKERR_MSG(sqlite3_open_v2(cachePath.c_str(), &m_dbHandle, flags, nullptr),
+        "Failed to open tag cache file \"" << cachePath << "\"");
+
+    // Several MusicFS instances may share one cache; wait for each other rather than failing.
+    sqlite3_busy_timeout(m_dbHandle, 10000);
+
+    // It's only a cache: losing the most recent writes in a crash just means re-reading some tags.
+    CHECKERR(sqlite3_exec(m_dbHandle, "PRAGMA journal_mode = WAL;", nullptr, nullptr, nullptr));
+    CHECKERR(sqlite3_exec(m_dbHandle, "PRAGMA synchronous = OFF;", nullptr, nullptr, nullptr));
+
+    CHECKERR_MSG(sqlite3_exec(m_dbHandle, s_tableStatement, nullptr, nullptr, nullptr),
+        "Error in tag cache table creation statement");
+
+    const char lookup[] = "SELECT has_tag, title, artist, album, albumartist, disc, year, track "
+                        "FROM tags "
+                        "WHERE device = ? AND inode = ? AND size = ? AND mtime = ?;";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, lookup, sizeof(lookup), &m_lookup, nullptr));
+
+    const char store[] = "INSERT OR REPLACE INTO tags "
+                        "(device, inode, size, mtime, has_tag, title, artist, album, albumartist, disc, year, track) "
+                        "VALUES (?,?,?,?,?,?,?,?,?,?,?,?);";
+    CHECKERR(sqlite3_prepare_v2(m_dbHandle, store, sizeof(store), &m_store, nullptr));
+}
+
+TagCache::~TagCache()
+{
+    Flush();
+    sqlite3_finalize(m_lookup);
+    sqlite3_finalize(m_store);
+    sqlite3_close(m_dbHandle);
+}
+
+static void bind_identity(sqlite3_stmt *prepared, const struct stat& s)
+{
+    sqlite3_bind_int64(prepared, 1, s.st_dev);
+    sqlite3_bind_int64(prepared, 2, s.st_ino);
+    sqlite3_bind_int64(prepared, 3, s.st_size);
+    sqlite3_bind_int64(prepared, 4, s.st_mtime);
+}
+
+bool TagCache::Lookup(const struct stat& s, bool *has_tag, MusicTags& tags)
+{
+    sqlite3_reset(m_lookup);
+    bind_identity(m_lookup, s);
+
+    int result = sqlite3_step(m_lookup);
+    if (result == SQLITE_DONE)
+    {
+        return false;
+    }
+    else if (result != SQLITE_ROW)
+    {
+        CHECKERR(result);
+    }
+
+#define STRCOL(_n) reinterpret_cast<const char*>(sqlite3_column_text(m_lookup, _n))
+
+    *has_tag = (sqlite3_column_int(m_lookup, 0) != 0);
+    tags.title = STRCOL(1);
+    tags.artist = STRCOL(2);
+    tags.album = STRCOL(3);
+    tags.albumartist = STRCOL(4);
+    tags.disc = STRCOL(5);
+    tags.year = sqlite3_column_int(m_lookup, 6);
+    tags.track = sqlite3_column_int(m_lookup, 7);
+
+#undef STRCOL
+
+    sqlite3_reset(m_lookup);
+    return true;
+}
+
+void TagCache::Store(const struct stat& s, bool has_tag, const MusicTags& tags)
+{
+    if (m_pending.empty())
+        m_firstPending = chrono::steady_clock::now();
+
+    m_pending.emplace_back(new PendingStore{ s, has_tag, tags });
+
+    if (m_pending.size() >= s_batchSize
+        || chrono::steady_clock::now() - m_firstPending >= s_batchInterval)
+    {
+        Flush();
+    }
+}
+
+void TagCache::Flush()
+{
+    if (m_pending.empty())
+        return;
+
+    // Take the write lock up front: a deferred transaction that starts by reading can't be
+    // upgraded if another instance wrote meanwhile, and would fail without waiting.
+    int result = sqlite3_exec(m_dbHandle, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+    for (size_t i = 0; result == SQLITE_OK && i < m_pending.size(); i++)
+    {
+        const PendingStore& pending = *m_pending[i];
+        const MusicTags& tags = pending.tags;
+
+        sqlite3_reset(m_store);
+        bind_identity(m_store, pending.s);
+        sqlite3_bind_int(m_store, 5, pending.has_tag ? 1 : 0);
+        sqlite3_bind_text(m_store, 6, tags.title.c_str(), tags.title.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(m_store, 7, tags.artist.c_str(), tags.artist.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(m_store, 8, tags.album.c_str(), tags.album.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(m_store, 9, tags.albumartist.c_str(), tags.albumartist.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(m_store, 10, tags.disc.c_str(), tags.disc.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_int(m_store, 11, tags.year);
+        sqlite3_bind_int(m_store, 12, tags.track);
+
+        result = sqlite3_step(m_store);
+        if (result == SQLITE_DONE)
+            result = SQLITE_OK;
+    }
+    sqlite3_reset(m_store);
+
+    if (result == SQLITE_OK)
+        result = sqlite3_exec(m_dbHandle, "COMMIT;", nullptr, nullptr, nullptr);
+
+    if (result != SQLITE_OK)
+    {
+        WARN("Failed to write " << m_pending.size() << " entries to the tag cache: "
+            << sqlite3_errmsg(m_dbHandle));
+        if (!sqlite3_get_autocommit(m_dbHandle))
+            sqlite3_exec(m_dbHandle, "ROLLBACK;", nullptr, nullptr, nullptr);
+    }
+
+    m_pending.clear();
+}
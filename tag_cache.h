@@ -0,0 +1,52 @@
+//
+// MusicFS :: Shared Tag Extraction Cache
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+struct stat;
+struct MusicTags;
+
+// Remembers what TagLib extracted from each file, keyed by the file's identity (device, inode,
+// size, and mtime) rather than its path, so it can be shared by any number of MusicFS databases
+// over the same files, and survives the database being deleted and rebuilt.
+//
+// Stores are held in memory and written in small batches, each in a transaction of its own, so
+// other instances sharing the cache are never kept waiting on its write lock for long.
+class TagCache
+{
+public:
+    TagCache(const std::string& cachePath);
+    ~TagCache();
+
+    TagCache(const TagCache&) = delete;
+    TagCache& operator=(const TagCache&) = delete;
+
+    // Returns false if the file isn't in the cache, or has changed since it was stored.
+    // Otherwise, has_tag says whether TagLib found any tags, and if so, they're put in tags.
+    bool Lookup(const struct stat& s, bool *has_tag, MusicTags& tags);
+    void Store(const struct stat& s, bool has_tag, const MusicTags& tags);
+
+    // Writes out any stores not yet written. Failing to (because other instances have kept the
+    // cache locked too long) just means those files' tags are read again next time.
+    void Flush();
+
+private:
+    struct PendingStore;
+
+    sqlite3 *m_dbHandle;
+    sqlite3_stmt *m_lookup;
+    sqlite3_stmt *m_store;
+
+    std::vector<std::unique_ptr<PendingStore>> m_pending;
+    std::chrono::steady_clock::time_point m_firstPending;
+};
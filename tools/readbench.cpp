@@ -0,0 +1,143 @@
+//
+// Sequential Read Benchmark
+//
+// Reads files from start to finish, the way a player streams them, and reports the throughput
+// and the CPU time spent per gigabyte read, both by this program and (given its PID) by the
+// MusicFS process serving the mount. Each file is evicted from the mount's page cache before it's
+// read, so every byte goes through MusicFS. Run it against the same files with different MusicFS
+// builds to compare read paths.
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+// Returns the CPU time (user + system) used so far by the given process, in seconds, or -1.
+static double process_cpu_time(pid_t pid)
+{
+    ifstream stat("/proc/" + to_string(pid) + "/stat");
+    string contents;
+    if (!getline(stat, contents))
+        return -1;
+
+    // The command name can contain spaces, so start counting fields after its closing paren.
+    size_t pos = contents.rfind(')');
+    if (pos == string::npos)
+        return -1;
+
+    vector<string> fields;
+    size_t start = pos + 2;
+    while (start < contents.size())
+    {
+        size_t end = contents.find(' ', start);
+        if (end == string::npos)
+            end = contents.size();
+        fields.push_back(contents.substr(start, end - start));
+        start = end + 1;
+    }
+
+    // utime and stime are fields 14 and 15 of the whole line; state (field 3) is fields[0] here.
+    if (fields.size() < 13)
+        return -1;
+
+    double ticks = strtod(fields[11].c_str(), nullptr) + strtod(fields[12].c_str(), nullptr);
+    return ticks / sysconf(_SC_CLK_TCK);
+}
+
+static double own_cpu_time()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    size_t block_size = 128 * 1024;
+    pid_t pid = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:p:")) != -1)
+    {
+        switch (c)
+        {
+        case 'b':
+            block_size = strtoul(optarg, nullptr, 10);
+            break;
+        case 'p':
+            pid = atoi(optarg);
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+
+    if (optind >= argc || block_size == 0)
+    {
+        cerr << "usage: readbench [-b <block size>] [-p <musicfs pid>] <file>...\n";
+        return -1;
+    }
+
+    vector<char> buf(block_size);
+    unsigned long long total = 0;
+
+    double daemon_start = (pid != 0) ? process_cpu_time(pid) : -1;
+    double own_start = own_cpu_time();
+    auto start = chrono::steady_clock::now();
+
+    for (int i = optind; i < argc; i++)
+    {
+        int fd = open(argv[i], O_RDONLY);
+        if (fd == -1)
+        {
+            cerr << argv[i] << ": " << strerror(errno) << endl;
+            continue;
+        }
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+        ssize_t n;
+        while ((n = read(fd, buf.data(), buf.size())) > 0)
+        {
+            total += n;
+        }
+        if (n == -1)
+        {
+            cerr << argv[i] << ": " << strerror(errno) << endl;
+        }
+
+        close(fd);
+    }
+
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double own_cpu = own_cpu_time() - own_start;
+    double gigabytes = total / 1e9;
+
+    cout << total << " bytes in " << elapsed << " s: " << (total / 1e6 / elapsed) << " MB/s\n";
+    if (gigabytes > 0)
+    {
+        cout << "readbench CPU: " << (own_cpu / gigabytes) << " s/GB\n";
+        if (daemon_start >= 0)
+        {
+            double daemon_cpu = process_cpu_time(pid) - daemon_start;
+            cout << "musicfs CPU: " << (daemon_cpu / gigabytes) << " s/GB\n";
+        }
+    }
+
+    return 0;
+}
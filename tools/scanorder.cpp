@@ -0,0 +1,83 @@
+//
+// Disk Position Ordering Utility
+//
+// Reads file paths from standard input, one per line, and prints them in the order MusicFS's
+// physical_order scan option would read them, along with their disk positions. Also reports the
+// total distance a disk head would travel visiting them in that order, for comparison with the
+// input order (given -u).
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <string.h>
+
+#include "../disk_layout.h"
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    bool sorted = true;
+
+    if (argc == 2 && strcmp(argv[1], "-u") == 0)
+    {
+        sorted = false;
+    }
+    else if (argc != 1)
+    {
+        cerr << "usage: scanorder [-u] < file_list\n"
+            << "    -u  don't sort; print positions in input order\n";
+        return -1;
+    }
+
+    vector<pair<DiskPosition, string>> files;
+    string line;
+    while (getline(cin, line))
+    {
+        if (line.empty())
+            continue;
+        files.emplace_back(get_disk_position(line), line);
+    }
+
+    if (sorted)
+    {
+        stable_sort(files.begin(), files.end(),
+            [](const pair<DiskPosition, string>& a, const pair<DiskPosition, string>& b)
+            {
+                return a.first < b.first;
+            });
+    }
+
+    unsigned long long distance = 0;
+    size_t physical_count = 0;
+    const DiskPosition *previous = nullptr;
+    for (const auto& file : files)
+    {
+        const DiskPosition& pos = file.first;
+        cout << pos.device << "\t" << (pos.physical ? "extent" : "inode") << "\t"
+            << pos.offset << "\t" << file.second << "\n";
+
+        if (pos.physical)
+        {
+            physical_count++;
+            if (previous != nullptr && previous->physical && previous->device == pos.device)
+            {
+                distance += (pos.offset > previous->offset)
+                    ? (pos.offset - previous->offset)
+                    : (previous->offset - pos.offset);
+            }
+        }
+        previous = &pos;
+    }
+
+    cerr << files.size() << " files, " << physical_count << " with known extents\n"
+        << "total seek distance: " << distance << " bytes\n";
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+//
+// Batched stat() Benchmark
+//
+// Walks a directory tree, then stats every file in it using the given method, and reports how
+// long that took. With -d, each directory's files are stat'ed as a batch of their own, the way a
+// scan does, rather than all in one batch. Drop the page cache between runs (echo 3 > /proc/sys/vm/drop_caches) or run
+// each method on a fresh mount to get meaningful numbers.
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <string.h>
+
+#include "../batch_stat.h"
+
+using namespace std;
+
+int musicfs_log_level = 0;
+bool musicfs_log_stderr = true;
+
+int main(int argc, char **argv)
+{
+    bool perDirectory = (argc == 4 && strcmp(argv[1], "-d") == 0);
+    if (perDirectory)
+    {
+        argc--;
+        argv++;
+    }
+
+    if (argc != 3)
+    {
+        cerr << "usage: statbench [-d] <sync|threads|uring> <directory>\n";
+        return -1;
+    }
+
+    BatchStat::Method method;
+    if (strcmp(argv[1], "sync") == 0)
+        method = BatchStat::Method::Sync;
+    else if (strcmp(argv[1], "threads") == 0)
+        method = BatchStat::Method::Threads;
+    else if (strcmp(argv[1], "uring") == 0)
+        method = BatchStat::Method::Auto;
+    else
+    {
+        cerr << "unknown method " << argv[1] << "\n";
+        return -1;
+    }
+
+    vector<vector<string>> batches(1);
+    deque<string> directories;
+    directories.push_back(argv[2]);
+    while (!directories.empty())
+    {
+        string path = directories.front();
+        directories.pop_front();
+
+        DIR *dir = opendir(path.c_str());
+        if (dir == nullptr)
+            continue;
+
+        if (perDirectory && !batches.back().empty())
+            batches.emplace_back();
+        vector<string>& files = batches.back();
+
+        dirent *e;
+        while ((e = readdir(dir)) != nullptr)
+        {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+                continue;
+
+            string full_path = path + "/" + e->d_name;
+            if (e->d_type == DT_DIR)
+                directories.push_back(move(full_path));
+            else
+                files.push_back(move(full_path));
+        }
+        closedir(dir);
+    }
+
+    BatchStat statter(method);
+    vector<StatResult> results;
+    size_t count = 0;
+    size_t errors = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (const vector<string>& files : batches)
+    {
+        statter.Stat(files, results);
+        count += files.size();
+        for (const StatResult& r : results)
+        {
+            if (r.error != 0)
+                errors++;
+        }
+    }
+    auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << statter.GetMethodName() << ": " << count << " files (" << errors << " errors) in "
+        << batches.size() << " batches, " << elapsed << " s, " << (count / elapsed) << " stats/s\n";
+
+    return 0;
+}
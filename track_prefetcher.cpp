@@ -0,0 +1,212 @@
+//
+// MusicFS :: Next-Track Prefetching
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MUSICFS_LOG_SUBSYS "TrackPrefetcher"
+#include "logging.h"
+
+#include "database.h"
+#include "fd_pool.h"
+#include "track_prefetcher.h"
+
+using namespace std;
+
+// How much is read at a time when reading the start of a track.
+static const size_t s_readSize = 128 * 1024;
+
+TrackPrefetcher::TrackPrefetcher(
+        const string& base_path,
+        MusicDatabase& db,
+        FdPool& fdPool,
+        const function<bool(const string&, const string&)>& file_preference,
+        size_t head_bytes
+        )
+    : m_basePath(base_path)
+    , m_db(db)
+    , m_fdPool(fdPool)
+    , m_filePreference(file_preference)
+    , m_headBytes(head_bytes)
+    , m_stopping(false)
+    , m_lastPrefetched(-1)
+    , m_requests(0)
+    , m_prefetches(0)
+    , m_prefetchedBytes(0)
+    , m_lastTracks(0)
+    , m_failures(0)
+{
+}
+
+TrackPrefetcher::~TrackPrefetcher()
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_stopping = true;
+        m_queue.clear();
+    }
+    m_cv.notify_all();
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void TrackPrefetcher::TrackNearlyDone(int path_id)
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_requests++;
+        if (find(m_queue.begin(), m_queue.end(), path_id) != m_queue.end())
+            return;
+
+        m_queue.push_back(path_id);
+        if (!m_thread.joinable())
+            m_thread = thread(&TrackPrefetcher::Worker, this);
+    }
+    m_cv.notify_one();
+}
+
+void TrackPrefetcher::Worker()
+{
+    unique_lock<mutex> lock(m_lock);
+    for (;;)
+    {
+        m_cv.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+        if (m_stopping)
+            return;
+
+        int path_id = m_queue.front();
+        m_queue.pop_front();
+
+        lock.unlock();
+        try
+        {
+            Prefetch(path_id);
+        }
+        catch (exception *)
+        {
+            ERROR("failed to look up the track after path " << path_id);
+        }
+        lock.lock();
+    }
+}
+
+void TrackPrefetcher::Prefetch(int path_id)
+{
+    int parent_id;
+    if (!m_db.GetParentOfPath(path_id, &parent_id))
+        return;
+
+    // The next track is the next file, by name, of those the directory lists. With the usual path
+    // patterns, names start with the track number.
+    auto children = m_db.GetChildrenOfPath(parent_id, m_filePreference);
+    sort(children.begin(), children.end(),
+        [](const tuple<int, string, string, struct stat>& a, const tuple<int, string, string, struct stat>& b)
+        {
+            return get<1>(a) < get<1>(b);
+        });
+
+    auto current = find_if(children.begin(), children.end(),
+        [path_id](const tuple<int, string, string, struct stat>& child)
+        {
+            return get<0>(child) == path_id;
+        });
+    if (current == children.end())
+        return;
+
+    auto next = find_if(current + 1, children.end(),
+        [](const tuple<int, string, string, struct stat>& child)
+        {
+            return !get<2>(child).empty();
+        });
+    if (next == children.end())
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_lastTracks++;
+        return;
+    }
+
+    int next_id = get<0>(*next);
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (next_id == m_lastPrefetched)
+            return;
+        m_lastPrefetched = next_id;
+    }
+
+    int file_id;
+    string realPath;
+    struct stat known;
+    if (!m_db.GetFileForPath(next_id, &file_id, realPath, &known) || file_id == 0)
+        return;
+
+    string fullPath = m_basePath + realPath;
+    DEBUG("prefetching " << fullPath);
+
+    int fd = m_fdPool.Acquire(file_id, fullPath, known);
+    if (fd == -1)
+    {
+        PERROR("prefetch: open(" << fullPath << ")");
+        lock_guard<mutex> lock(m_lock);
+        m_failures++;
+        return;
+    }
+
+    // Some filesystems ignore the hint, so read it as well; either way it ends up in the page
+    // cache, where reads through the mount will find it.
+    posix_fadvise(fd, 0, m_headBytes, POSIX_FADV_WILLNEED);
+
+    vector<char> buf(s_readSize);
+    size_t total = 0;
+    while (total < m_headBytes)
+    {
+        ssize_t n = pread(fd, buf.data(), min(buf.size(), m_headBytes - total), total);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == -1)
+                PERROR("prefetch: read(" << fullPath << ")");
+            break;
+        }
+        total += n;
+    }
+
+    m_fdPool.Release(fd);
+
+    lock_guard<mutex> lock(m_lock);
+    m_prefetches++;
+    m_prefetchedBytes += total;
+}
+
+string TrackPrefetcher::GetState() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    stringstream ss;
+    ss << "head_bytes: " << m_headBytes << "\n"
+        << "queued: " << m_queue.size() << "\n"
+        << "requests: " << m_requests << "\n"
+        << "prefetches: " << m_prefetches << "\n"
+        << "prefetched_bytes: " << m_prefetchedBytes << "\n"
+        << "last_tracks: " << m_lastTracks << "\n"
+        << "failures: " << m_failures << "\n";
+    return ss.str();
+}
@@ -0,0 +1,68 @@
+//
+// MusicFS :: Next-Track Prefetching
+//
+// Copyright (c) 2014-2015 by William R. Fraser
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class MusicDatabase;
+class FdPool;
+
+// Albums are mostly played in order, so once a track has been mostly read, the next one in the
+// same directory is likely to be opened soon. This opens it ahead of time and reads the start of
+// it into the page cache, in the background, so that on storage that has to spin up or is far
+// away, playback moves on to it without a gap. The opened file stays in the FdPool for the player
+// to pick up.
+class TrackPrefetcher
+{
+public:
+    TrackPrefetcher(
+        const std::string& base_path,
+        MusicDatabase& db,
+        FdPool& fdPool,
+        const std::function<bool(const std::string&, const std::string&)>& file_preference,
+        size_t head_bytes
+        );
+    ~TrackPrefetcher();
+
+    TrackPrefetcher(const TrackPrefetcher&) = delete;
+    TrackPrefetcher& operator=(const TrackPrefetcher&) = delete;
+
+    // Call when the given path has been read far enough that the next track should be fetched.
+    // Returns right away. The worker thread is started the first time this is called, rather
+    // than when the prefetcher is created, so that it survives the process daemonizing.
+    void TrackNearlyDone(int path_id);
+
+    std::string GetState() const;
+
+private:
+    void Worker();
+    void Prefetch(int path_id);
+
+    const std::string m_basePath;
+    MusicDatabase& m_db;
+    FdPool& m_fdPool;
+    const std::function<bool(const std::string&, const std::string&)> m_filePreference;
+    const size_t m_headBytes;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<int> m_queue; // path IDs
+    std::thread m_thread;
+    bool m_stopping;
+    int m_lastPrefetched;    // path ID, so replaying the end of a track doesn't fetch again
+
+    unsigned long long m_requests;
+    unsigned long long m_prefetches;
+    unsigned long long m_prefetchedBytes;
+    unsigned long long m_lastTracks;
+    unsigned long long m_failures;
+};
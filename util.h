@@ -18,6 +18,22 @@ inline std::string join(const std::vector<std::string>& vec, const std::string&
     return result.str();
 }
 
+inline std::vector<std::string> split(const char *str, char separator)
+{
+    std::vector<std::string> values;
+    for (size_t start = 0, end = 0; ; end++)
+    {
+        if (str[end] == separator || str[end] == '\0')
+        {
+            values.emplace_back(str + start, (end - start));
+            start = end + 1;
+        }
+        if (str[end] == '\0')
+            break;
+    }
+    return values;
+}
+
 inline bool iendsWith(const std::string& haystack, const std::string& needle)
 {
     return (haystack.size() >= needle.size())